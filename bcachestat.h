@@ -0,0 +1,8 @@
+// Disk block cache statistics reported by bcachestat().
+struct bcachestat {
+  uint nbuf;       // buffers in the cache now
+  uint maxbuf;     // most buffers it may grow to
+  uint hits;       // lookups that found the block cached
+  uint misses;     // lookups that had to read the block
+  uint evictions;  // cached blocks dropped to make room
+};
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,42 +17,233 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Each hash bucket has its own lock, which protects the chain
+// and the refcnt and used fields of the buffers on it, so
+// cache hits on different blocks do not contend.  Misses take
+// bcache.lock as well, which serializes recycling: a CLOCK hand
+// sweeps the buffers, skipping ones used since its last pass.
+//
+// Buffers live in pages taken from kalloc, BPERPAGE to a page.
+// The cache starts with NBUF buffers and grows a page at a time
+// on misses while free memory is plentiful, up to bcache.maxbuf
+// (NBUFMAX at boot, changed with bsetmax).  When kalloc runs out
+// of memory it calls bshrink, which gives back a page whose
+// buffers are all idle, as long as NBUF remain.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "x86.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "memstat.h"
+#include "bcachestat.h"
+
+#define NBUCKET   127
+#define BRESERVE  256   // free pages to leave alone when growing
+
+struct bpage {
+  struct bpage *next;
+  struct buf buf[(PGSIZE - sizeof(struct bpage*)) / sizeof(struct buf)];
+};
+
+#define BPERPAGE  (sizeof(((struct bpage*)0)->buf) / sizeof(struct buf))
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct bpage *pages;  // all pages of buffers
+  int nbuf;
+  int maxbuf;           // most buffers to grow to
+  struct bpage *hand;   // where the CLOCK hand points:
+  int handi;            // hand->buf[handi]
+
+  // Hash chains of buffers through next, by (dev, blockno).
+  struct {
+    struct spinlock lock;
+    struct buf *head;
+  } bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  uint hits;
+  uint misses;
+  uint evictions;
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Add b to its hash chain.
+static void
+blink(struct buf *b)
+{
+  int h;
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->next = bcache.bucket[h].head;
+  bcache.bucket[h].head = b;
+  release(&bcache.bucket[h].lock);
+}
+
+// Take b off its hash chain.  Caller holds the bucket lock.
+static void
+bunlink(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bcache.bucket[bhash(b->dev, b->blockno)].head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+}
+
+// Add a page of buffers to the cache, unless it is
+// already at bcache.maxbuf buffers or memory is short.
+// Returns 0 on success, -1 otherwise.
+static int
+bgrow(void)
+{
+  struct bpage *bp;
+  struct buf *b;
+
+  if(bcache.nbuf + BPERPAGE > bcache.maxbuf || (bp = (struct bpage*)kalloc()) == 0)
+    return -1;
+  ksetuse((char*)bp, MS_BCACHE);
+
+  // New buffers start out as block 0 of device 0,
+  // which is never read: they hold no valid data.
+  for(b = bp->buf; b < bp->buf+BPERPAGE; b++){
+    b->flags = 0;
+    b->dev = 0;
+    b->blockno = 0;
+    b->refcnt = 0;
+    b->used = 0;
+    b->iodone = 0;
+    initsleeplock(&b->lock, "buffer");
+  }
+
+  acquire(&bcache.lock);
+  if(bcache.nbuf + BPERPAGE > bcache.maxbuf){
+    release(&bcache.lock);
+    kfree((char*)bp);
+    return -1;
+  }
+  for(b = bp->buf; b < bp->buf+BPERPAGE; b++)
+    blink(b);
+  bp->next = bcache.pages;
+  bcache.pages = bp;
+  bcache.nbuf += BPERPAGE;
+  // Point the hand at the new buffers, which are free.
+  bcache.hand = bp;
+  bcache.handi = 0;
+  release(&bcache.lock);
+  return 0;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  bcache.maxbuf = NBUFMAX;
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  while(bcache.nbuf < NBUF)
+    if(bgrow() < 0)
+      panic("binit");
+}
+
+// Give a page of idle buffers back to kalloc, keeping at least
+// NBUF buffers.  Returns 1 if a page was freed, 0 if not.
+int
+bshrink(void)
+{
+  struct bpage *bp, **pp;
+  struct buf *b;
+  struct spinlock *lk;
+  int i;
+
+  acquire(&bcache.lock);
+  if(bcache.nbuf - BPERPAGE < NBUF){
+    release(&bcache.lock);
+    return 0;
   }
+  for(pp = &bcache.pages; (bp = *pp) != 0; pp = &bp->next){
+    // Take the page's buffers out of the hash table one by one;
+    // if one turns out to be busy, put the others back.
+    for(i = 0; i < BPERPAGE; i++){
+      b = &bp->buf[i];
+      lk = &bcache.bucket[bhash(b->dev, b->blockno)].lock;
+      acquire(lk);
+      if(b->refcnt != 0 || (b->flags & B_DIRTY) != 0){
+        release(lk);
+        break;
+      }
+      bunlink(b);
+      release(lk);
+    }
+    if(i < BPERPAGE){
+      while(--i >= 0)
+        blink(&bp->buf[i]);
+      continue;
+    }
+
+    *pp = bp->next;
+    bcache.nbuf -= BPERPAGE;
+    if(bcache.hand == bp){
+      bcache.hand = bcache.pages;
+      bcache.handi = 0;
+    }
+    release(&bcache.lock);
+    kfree((char*)bp);
+    return 1;
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
+// Let the cache grow to max buffers, and give back idle pages
+// until it is no bigger.  Returns the old limit, or -1 if max
+// is below NBUF.
+int
+bsetmax(int max)
+{
+  int old;
+
+  if(max < NBUF)
+    return -1;
+  acquire(&bcache.lock);
+  old = bcache.maxbuf;
+  bcache.maxbuf = max;
+  release(&bcache.lock);
+  while(bcache.nbuf > max && bshrink())
+    ;
+  return old;
+}
+
+// Find the buffer for block on device dev in its bucket and
+// take a reference to it.  Caller holds the bucket lock.
+static struct buf*
+bfind(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[bhash(dev, blockno)].head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      b->used = 1;
+      return b;
+    }
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -62,34 +253,90 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct spinlock *lk;
+  int h, i;
 
-  acquire(&bcache.lock);
+  h = bhash(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b){
+    xadd(&bcache.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
   }
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // Not cached.  Use a new buffer rather than evict
+  // one while there is memory to spare.
+  xadd(&bcache.misses, 1);
+  if(freemem() > BRESERVE)
+    bgrow();
+
+  for(;;){
+    // Only one process recycles at a time, so look again
+    // in case another one just brought the block in.
+    acquire(&bcache.lock);
+    acquire(&bcache.bucket[h].lock);
+    b = bfind(dev, blockno);
+    release(&bcache.bucket[h].lock);
+    if(b){
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+
+    // Recycle an unused buffer.  Buffers only change buckets
+    // under bcache.lock, so b's bucket is stable here.
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    for(i = 0; i < 2*bcache.nbuf; i++){
+      b = &bcache.hand->buf[bcache.handi];
+      if(++bcache.handi == BPERPAGE){
+        bcache.hand = bcache.hand->next ? bcache.hand->next : bcache.pages;
+        bcache.handi = 0;
+      }
+      lk = &bcache.bucket[bhash(b->dev, b->blockno)].lock;
+      acquire(lk);
+      if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+        if(b->used){
+          b->used = 0;
+        } else {
+          bunlink(b);
+          release(lk);
+          if(b->flags & B_VALID)
+            bcache.evictions++;
+          b->dev = dev;
+          b->blockno = blockno;
+          b->flags = 0;
+          b->refcnt = 1;
+          b->used = 1;
+          blink(b);
+          release(&bcache.lock);
+          acquiresleep(&b->lock);
+          return b;
+        }
+      }
+      release(lk);
+    }
+    release(&bcache.lock);
+
+    // Every buffer is in use; add some even if memory is short.
+    if(bgrow() < 0)
+      panic("bget: no buffers");
   }
-  panic("bget: no buffers");
+}
+
+// Fill in the cache's size and hit, miss and eviction counts.
+void
+bcachestat(struct bcachestat *st)
+{
+  st->nbuf = bcache.nbuf;
+  st->maxbuf = bcache.maxbuf;
+  st->hits = bcache.hits;
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +352,63 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block, without reading
+// it, for a caller that is about to overwrite all of it.
+// The buf is marked valid, so that a later bread() does not
+// take a log_write()'s B_DIRTY as a request to write it home.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Finish a read started by breadahead(): give up the lock and
+// reference it left behind.  Called from the disk interrupt,
+// so it cannot use brelse(), which checks who holds the lock.
+static void
+bendio(struct buf *b)
+{
+  int h;
+
+  releasesleep(&b->lock);
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  release(&bcache.bucket[h].lock);
+}
+
+// Start reading block blockno of device dev into the cache
+// without waiting for it, unless it is cached already.  The
+// disk driver calls bendio() when the read is done.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h;
+
+  h = bhash(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
+  for(b = bcache.bucket[h].head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bcache.bucket[h].lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->iodone = bendio;
+  idesubmit(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +419,47 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Start writing b's contents to disk, without waiting.
+// Several writes can be submitted at once to keep the disk
+// busy; call bwait() on each before releasing it.  Must be locked.
+void
+bsubmit(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bsubmit");
+  b->flags |= B_DIRTY;
+  idesubmit(b);
+}
+
+// Wait for the write of b started by bsubmit() to finish.
+void
+bwait(struct buf *b)
+{
+  idewaitbuf(b);
+}
+
+// Whether the write of b started by bsubmit() has finished.
+int
+bpoll(struct buf *b)
+{
+  return (b->flags & (B_VALID|B_DIRTY)) == B_VALID;
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 //PAGEBREAK!
 // Blank page.
-
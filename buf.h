@@ -4,9 +4,12 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int used;          // referenced since the CLOCK hand last passed
+  struct buf *next;  // hash chain
   struct buf *qnext; // disk queue
+  uint64 qtime;      // when it joined the disk queue
+  void (*iodone)(struct buf*); // called when a submitted request is done;
+                               // then nobody may wait for the buf
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
@@ -1,9 +1,14 @@
+struct bcachestat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct iostat;
+struct memstat;
 struct pipe;
 struct proc;
+struct rb_node;
+struct rb_root;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
@@ -11,9 +16,17 @@ struct stat;
 struct superblock;
 
 // bio.c
+void            bcachestat(struct bcachestat*);
 void            binit(void);
+struct buf*     bnew(uint, uint);
+int             bpoll(struct buf*);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
+int             bsetmax(int);
+int             bshrink(void);
+void            bsubmit(struct buf*);
+void            bwait(struct buf*);
 void            bwrite(struct buf*);
 
 // console.c
@@ -36,10 +49,12 @@ int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            dcacheset(struct inode*, char*, uint, uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, struct inode*);
 struct inode*   idup(struct inode*);
+int             ifreeblocks(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -50,25 +65,42 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
+extern int      ideirq;
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            idewaitbuf(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
 extern uchar    ioapicid;
 void            ioapicinit(void);
 
+// iosched.c
+void            ioqadd(struct buf*);
+void            ioqdone(struct buf*);
+struct buf*     ioqnext(int);
+void            ioschedinit(void);
+int             setiosched(int);
+void            iostat(struct iostat*);
+
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+int             kgetuse(char*);
+void            kincref(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             krefcount(char*);
+void            ksetuse(char*, int);
 int             freemem(void);
+void            memstat(struct memstat*);
 
 // kbd.c
 void            kbdintr(void);
@@ -79,19 +111,29 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
+void            lapiconeshot(uint);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
+uint            tscruntime(uint64);
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+int             log_maxop(void);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pci.c
+int             pcifind(int, int, int, int, uint*);
+uint            pciread(uint, int);
+void            pciwrite(uint, int, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -111,8 +153,10 @@ int		        getnice(int);
 int		        setnice(int, int);
 int             growproc(int);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 uint            mmap(uint, int, int, int, int, int);
 int             munmap(uint);
+void            munmapall(struct proc*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 int             page_fault_handler(uint error);
@@ -123,6 +167,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             slicetick(void);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -141,6 +186,14 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// rbtree.c
+void            rb_erase(struct rb_node*, struct rb_root*);
+struct rb_node* rb_first(struct rb_root*);
+void            rb_insert(struct rb_node*, struct rb_root*);
+struct rb_node* rb_last(struct rb_root*);
+struct rb_node* rb_next(struct rb_node*);
+struct rb_node* rb_prev(struct rb_node*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -159,6 +212,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argoutptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -189,6 +243,9 @@ void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+int             cowfault(pde_t*, uint);
+int             cowbreak(pde_t*, uint, uint);
+int             sharepage(pde_t*, uint*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -2,6 +2,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
@@ -19,7 +21,7 @@ exec(char *path, char **argv)
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
-  begin_op();
+  begin_opn(ifreeblocks());
 
   if((ip = namei(path)) == 0){
     end_op();
@@ -95,6 +97,7 @@ exec(char *path, char **argv)
 
   // Commit to the user image.
   oldpgdir = curproc->pgdir;
+  munmapall(curproc);
   curproc->pgdir = pgdir;
   curproc->sz = sz;
   curproc->tf->eip = elf.entry;  // main
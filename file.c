@@ -73,7 +73,7 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
   else if(ff.type == FD_INODE){
-    begin_op();
+    begin_opn(ifreeblocks());
     iput(ff.ip);
     end_op();
   }
@@ -104,8 +104,19 @@ fileread(struct file *f, char *addr, int n)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
     ilock(f->ip);
+    // While reads are sequential, keep the blocks up to READAHEAD
+    // past this one on their way, topping up half a window at a time.
+    if(f->off != f->ranext)
+      f->raend = f->off;
+    else if(f->raend < f->off + n + READAHEAD*BSIZE/2){
+      if(f->raend < f->off)
+        f->raend = f->off;
+      readahead(f->ip, f->raend, f->off + n + READAHEAD*BSIZE - f->raend);
+      f->raend = f->off + n + READAHEAD*BSIZE;
+    }
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
     return r;
   }
@@ -125,19 +136,20 @@ filewrite(struct file *f, char *addr, int n)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size, and reserve
+    // what each piece needs: its data blocks plus one
+    // of slop for a non-aligned write, as many allocation
+    // blocks, the i-node and up to three indirect blocks.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = ((log_maxop()-1-3-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(2*((n1 + BSIZE-1)/BSIZE + 1) + 1 + 3);
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
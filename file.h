@@ -6,6 +6,8 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint ranext; // where the next read starts if it is sequential
+  uint raend;  // read-ahead has been started up to here
 };
 
 
@@ -22,7 +24,15 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  uint indbn;         // bmap's cache: indaddr maps from block indbn-1
+  uint indaddr;       // an indirect block under addrs[NDIRECT+1]
+  uint bnext;         // where bmap looks for the next free block
+
+  struct inode *hnext; // icache hash chain
+  struct inode *prev;  // icache LRU list, while ref is 0
+  struct inode *next;
 };
 
 // table mapping major device number to
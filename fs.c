@@ -14,8 +14,9 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -44,33 +45,156 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// The free map is a run of bitmap blocks, each describing the
+// next BPB blocks of the disk, or, with FS_GROUPS, one bitmap
+// block per group describing the blocks of that group.  Map k
+// is bitmap block mapblock(k) and describes maplen(k) blocks
+// starting at mapfirst(k).
+
+#define NMAP 64  // most bitmap blocks or groups
+
+static uint
+nmaps(void)
+{
+  if(sb.features & FS_GROUPS)
+    return sb.ngroups;
+  return (sb.size + BPB - 1) / BPB;
+}
+
+static uint
+mapfirst(uint k)
+{
+  if(sb.features & FS_GROUPS)
+    return GSTART(k, sb);
+  return k*BPB;
+}
+
+static uint
+maplen(uint k)
+{
+  uint n;
+
+  n = sb.size - mapfirst(k);
+  if(sb.features & FS_GROUPS)
+    return n < sb.groupsize ? n : sb.groupsize;
+  return n < BPB ? n : BPB;
+}
+
+// Inode groups: with FS_GROUPS, group k holds the ipg inodes
+// starting at k*ipg; otherwise all inodes are in group 0.
+static uint
+ngroups(void)
+{
+  return sb.features & FS_GROUPS ? sb.ngroups : 1;
+}
+
+static uint
+igroup(uint inum)
+{
+  return sb.features & FS_GROUPS ? IGROUP(inum, sb) : 0;
+}
+
+// Allocation hints, kept in memory so that balloc() and
+// ialloc() need not scan the disk from the start each time.
+// nfree[k] counts the free blocks that map k describes; it
+// only changes with that bitmap block's buf locked.
+// nifree[k] counts the free inodes of group k (all of them
+// are group 0 without FS_GROUPS); icache.lock protects it.
+// bnext and inext are where the last allocations ended;
+// they are only hints, so races on them are harmless.
+struct {
+  int nfree[NMAP];
+  int nifree[NMAP];
+  uint bnext;
+  uint inext;
+} alloc;
+
+// Count the free blocks in each map and the free inodes
+// in each group.  The log must have been recovered already.
+static void
+allocinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint k, bi, inum, i;
+
+  if(sb.size > FSSIZE || nmaps() > NMAP)
+    panic("allocinit: disk too big");
+  for(k = 0; k < nmaps(); k++){
+    bp = bread(dev, BBLOCK(mapfirst(k), sb));
+    alloc.nfree[k] = 0;
+    for(bi = 0; bi < maplen(k); bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        alloc.nfree[k]++;
+    brelse(bp);
+  }
+  for(inum = 0; inum < sb.ninodes; inum += IPB){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data;
+    for(i = inum == 0; i < IPB && inum + i < sb.ninodes; i++)  // not inode 0
+      if(dip[i].type == 0)
+        alloc.nifree[igroup(inum)]++;
+    brelse(bp);
+  }
+  alloc.inext = 1;
+}
 
-// Allocate a zeroed disk block.
+// The map describing block b.
 static uint
-balloc(uint dev)
+mapof(uint b)
 {
-  int b, bi, m;
+  if(sb.features & FS_GROUPS)
+    return BGROUP(b, sb);
+  return b/BPB;
+}
+
+// Allocate a zeroed disk block: the first free one at or
+// after goal, so that a file's blocks end up together.
+// Maps with nothing free are skipped, and the rest are
+// searched a word at a time.
+static uint
+balloc(uint dev, uint goal)
+{
+  int i, n, wi, bi;
+  uint k, w, *bits;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal < mapfirst(0) || goal >= sb.size)
+    goal = mapfirst(0);
+  n = nmaps();
+  // Look from goal to the end of its map, through the
+  // others, then at the start of goal's map.
+  for(i = 0; i <= n; i++){
+    k = (mapof(goal) + i) % n;
+    if(alloc.nfree[k] == 0)
+      continue;
+    bi = i == 0 ? goal - mapfirst(k) : 0;
+    bp = bread(dev, BBLOCK(mapfirst(k), sb));
+    bits = (uint*)bp->data;
+    for(wi = bi / 32; wi < BPB / 32; wi++){
+      w = bits[wi];
+      if(wi == bi / 32)
+        w |= (1U << (bi % 32)) - 1;  // skip the blocks before goal
+      if(w == 0xFFFFFFFF)
+        continue;
+      bi = wi*32 + __builtin_ctz(~w);
+      if(bi >= maplen(k))
+        break;
+      bits[wi] |= 1U << (bi % 32);  // Mark block in use.
+      alloc.nfree[k]--;
+      log_write(bp);
+      brelse(bp);
+      bzero(dev, mapfirst(k) + bi);
+      alloc.bnext = mapfirst(k) + bi + 1;
+      return mapfirst(k) + bi;
     }
     brelse(bp);
   }
@@ -85,11 +209,12 @@ bfree(int dev, uint b)
   int bi, m;
 
   bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
+  bi = BBIT(b, sb);
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  alloc.nfree[mapof(b)]++;
   log_write(bp);
   brelse(bp);
 }
@@ -102,14 +227,17 @@ bfree(int dev, uint b)
 // list of blocks holding the file's content.
 //
 // The inodes are laid out sequentially on disk at
-// sb.startinode. Each inode has a number, indicating its
-// position on the disk.
+// sb.inodestart, or with FS_GROUPS sb.ipg at a time after
+// each group's bitmap block. Each inode has a number,
+// indicating its position on the disk.
 //
-// The kernel keeps a cache of in-use inodes in memory
+// The kernel keeps a cache of inodes in memory
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The cached
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->valid.
+// Inodes nobody refers to stay cached, on an LRU list,
+// so that opening a file again need not read it from disk.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -120,9 +248,9 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
+//   may be recycled if ip->ref is zero. Otherwise ip->ref
+//   tracks the number of in-memory pointers to the entry
+//   (open files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
 //   decrements ref.
 //
@@ -130,7 +258,7 @@ bfree(int dev, uint b)
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -157,59 +285,211 @@ bfree(int dev, uint b)
 // The icache.lock spin-lock protects the allocation of icache
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// holds, one must hold icache.lock while using any of those fields,
+// or the hash chains and LRU list.
+//
+// Entries live in pages taken from kalloc, IPERPAGE to a page.
+// The cache starts with NINODE entries and grows a page at a
+// time, while free memory is plentiful, rather than recycle an
+// entry that still caches an inode; it stops at NINODEMAX.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET  61
+#define IRESERVE  256   // free pages to leave alone when growing
+
+struct ipage {
+  struct ipage *next;
+  struct inode inode[(PGSIZE - sizeof(struct ipage*)) / sizeof(struct inode)];
+};
+
+#define IPERPAGE  (sizeof(((struct ipage*)0)->inode) / sizeof(struct inode))
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct ipage *pages;  // all pages of entries
+  int ninode;
+  struct inode *bucket[NIBUCKET];  // hash chains through hnext, by (dev, inum)
+  struct inode lru;     // unreferenced entries, most recently used first
 } icache;
 
+static void dcacheinit(void);
+
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIBUCKET;
+}
+
+// Take ip off its hash chain, if it is on one.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  if(ip->inum == 0)
+    return;
+  for(pp = &icache.bucket[ihash(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+    ;
+  *pp = ip->hnext;
+}
+
+// Put ip on the LRU list: at the front if it caches an
+// inode worth keeping, at the back to be recycled first.
+static void
+lruadd(struct inode *ip, int front)
+{
+  struct inode *at;
+
+  at = front ? &icache.lru : icache.lru.prev;
+  ip->prev = at;
+  ip->next = at->next;
+  at->next->prev = ip;
+  at->next = ip;
+}
+
+static void
+lrudel(struct inode *ip)
+{
+  ip->prev->next = ip->next;
+  ip->next->prev = ip->prev;
+}
+
+// Add a page of entries to the cache, unless it is already
+// at NINODEMAX entries.  Returns 0 on success, -1 otherwise.
+static int
+igrow(void)
+{
+  struct ipage *pg;
+  struct inode *ip;
+
+  if(icache.ninode + IPERPAGE > NINODEMAX || (pg = (struct ipage*)kalloc()) == 0)
+    return -1;
+  memset(pg, 0, PGSIZE);
+  for(ip = pg->inode; ip < pg->inode+IPERPAGE; ip++)
+    initsleeplock(&ip->lock, "inode");
+
+  acquire(&icache.lock);
+  if(icache.ninode + IPERPAGE > NINODEMAX){
+    release(&icache.lock);
+    kfree((char*)pg);
+    return -1;
+  }
+  // New entries hold no inode: inum 0 is never used.
+  for(ip = pg->inode; ip < pg->inode+IPERPAGE; ip++)
+    lruadd(ip, 0);
+  pg->next = icache.pages;
+  icache.pages = pg;
+  icache.ninode += IPERPAGE;
+  release(&icache.lock);
+  return 0;
+}
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  dcacheinit();
+  icache.lru.prev = icache.lru.next = &icache.lru;
+  while(icache.ninode < NINODE)
+    if(igrow() < 0)
+      panic("iinit");
 
   readsb(dev, &sb);
-  cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
+  allocinit(dev);
+  if(sb.features & FS_GROUPS)
+    cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
+ groups %d of %d blocks, %d inodes\n", sb.size, sb.nblocks,
+            sb.ninodes, sb.nlog, sb.logstart, sb.ngroups,
+            sb.groupsize, sb.ipg);
+  else
+    cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-          sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+            sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
+            sb.bmapstart);
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcachepurge(struct inode*);
+
+// Choose the group for a new inode of type type in directory
+// dp, as ext2 does: a directory goes to a group with at least
+// the average number of free inodes and, of those, the most
+// free blocks, so that directories spread over the disk; any
+// other inode goes to dp's group, near its siblings.
+static uint
+igroupfor(short type, struct inode *dp)
+{
+  uint k, best;
+  int avg;
+
+  best = igroup(dp->inum);
+  if(type != T_DIR)
+    return best;
+  avg = 0;
+  for(k = 0; k < ngroups(); k++)
+    avg += alloc.nifree[k];
+  avg /= ngroups();
+  for(k = 0; k < ngroups(); k++)
+    if(alloc.nifree[k] > 0 && alloc.nifree[k] >= avg &&
+       alloc.nfree[k] > alloc.nfree[best])
+      best = k;
+  return best;
+}
 
 //PAGEBREAK!
-// Allocate an inode on device dev.
+// Allocate an inode on device dev for a new entry in dp.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, struct inode *dp)
 {
-  int inum;
+  int i, g, n, ipg, first, start, inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  // Search dp's group, or a new directory's, then the others,
+  // skipping full ones.  Within a group, start where the last
+  // allocation left off, and read each inode block once.
+  n = ngroups();
+  ipg = sb.features & FS_GROUPS ? sb.ipg : sb.ninodes;
+  g = igroupfor(type, dp);
+  start = 0;
+  bp = 0;
+  for(i = 0; i < n * ipg; i++){
+    first = (g + i / ipg) % n * ipg;
+    if(i % ipg == 0){
+      if(alloc.nifree[first / ipg] == 0){
+        i += ipg - 1;
+        continue;
+      }
+      start = alloc.inext > first && alloc.inext < first + ipg ? alloc.inext : first;
+    }
+    inum = first + (start - first + i) % ipg;
+    if(inum == 0)
+      continue;
+    if(bp == 0 || bp->blockno != IBLOCK(inum, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
+      acquire(&icache.lock);
+      alloc.nifree[igroup(inum)]--;
+      release(&icache.lock);
+      alloc.inext = inum + 1;
       return iget(dev, inum);
     }
-    brelse(bp);
   }
+  if(bp)
+    brelse(bp);
   panic("ialloc: no inodes");
 }
 
@@ -241,31 +521,44 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int grow;
 
+  grow = 1;
   acquire(&icache.lock);
+  for(;;){
+    // Is the inode already cached?
+    for(ip = icache.bucket[ihash(dev, inum)]; ip; ip = ip->hnext){
+      if(ip->dev == dev && ip->inum == inum){
+        if(ip->ref++ == 0)
+          lrudel(ip);
+        release(&icache.lock);
+        return ip;
+      }
+    }
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+    // Recycle the least recently used entry, unless it still
+    // caches an inode and there is memory to spare for more.
+    ip = icache.lru.prev;
+    if(grow && (ip == &icache.lru || ip->valid) && freemem() > IRESERVE){
       release(&icache.lock);
-      return ip;
+      grow = igrow() == 0;
+      acquire(&icache.lock);
+      continue;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    if(ip == &icache.lru)
+      panic("iget: no inodes");
+    break;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  lrudel(ip);
+  iunhash(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = icache.bucket[ihash(dev, inum)];
+  icache.bucket[ihash(dev, inum)] = ip;
   release(&icache.lock);
 
   return ip;
@@ -305,6 +598,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->indbn = 0;
+    ip->bnext = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -338,16 +633,24 @@ iput(struct inode *ip)
     release(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcachepurge(ip);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      acquire(&icache.lock);
+      alloc.nifree[igroup(ip->inum)]++;
+      release(&icache.lock);
+      if(ip->inum < alloc.inext)
+        alloc.inext = ip->inum;
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    lruadd(ip, ip->valid);
   release(&icache.lock);
 }
 
@@ -359,13 +662,40 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+// The most blocks an iput() that frees its inode writes:
+// the inode's block and every bitmap block.  An FS system
+// call that may drop the last reference to an inode must
+// reserve this much log space for it.
+int
+ifreeblocks(void)
+{
+  return 1 + nmaps();
+}
+
 //PAGEBREAK!
 // Inode content
 //
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The rest are listed
+// in indirect blocks that are listed in the double-indirect
+// block ip->addrs[NDIRECT+1].
+
+// Allocate a block for ip, right after the one it got last,
+// or else at the start of its group's data blocks, or without
+// groups where the last allocation on the disk ended.
+static uint
+bmapalloc(struct inode *ip)
+{
+  uint addr, goal;
+
+  if((goal = ip->bnext) == 0)
+    goal = sb.features & FS_GROUPS ? GDATA(IGROUP(ip->inum, sb), sb) : alloc.bnext;
+  addr = balloc(ip->dev, goal);
+  ip->bnext = addr + 1;
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -377,7 +707,7 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bmapalloc(ip);
     return addr;
   }
   bn -= NDIRECT;
@@ -385,11 +715,39 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = bmapalloc(ip);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = bmapalloc(ip);
+      log_write(bp);
+    }
+    brelse(bp);
+    return addr;
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Find the indirect block for bn.  Sequential access
+    // stays in one for a long time, so remember the last
+    // one and skip reading the double-indirect block.
+    if(ip->indbn != bn - bn%NINDIRECT + 1){
+      if((addr = ip->addrs[NDIRECT+1]) == 0)
+        ip->addrs[NDIRECT+1] = addr = bmapalloc(ip);
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      if((addr = a[bn / NINDIRECT]) == 0){
+        a[bn / NINDIRECT] = addr = bmapalloc(ip);
+        log_write(bp);
+      }
+      brelse(bp);
+      ip->indbn = bn - bn%NINDIRECT + 1;
+      ip->indaddr = addr;
+    }
+    bp = bread(ip->dev, ip->indaddr);
+    a = (uint*)bp->data;
+    if((addr = a[bn % NINDIRECT]) == 0){
+      a[bn % NINDIRECT] = addr = bmapalloc(ip);
       log_write(bp);
     }
     brelse(bp);
@@ -399,6 +757,24 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Free indirect block addr and the blocks it lists.
+static void
+ifree(uint dev, uint addr)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -407,7 +783,7 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
+  int i;
   struct buf *bp;
   uint *a;
 
@@ -419,16 +795,22 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    ifree(ip->dev, ip->addrs[NDIRECT]);
+    ip->addrs[NDIRECT] = 0;
+  }
+
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i])
+        ifree(ip->dev, a[i]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
   }
+  ip->indbn = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -475,6 +857,24 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   return n;
 }
 
+// Start reading the blocks that hold bytes [off, off+n) of ip
+// into the buffer cache without waiting, so that the readi()
+// calls that follow find them on their way.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end;
+
+  if(ip->type == T_DEV || off >= ip->size)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+  end = (off + n + BSIZE - 1) / BSIZE;
+  for(bn = off / BSIZE; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -519,32 +919,359 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache.
+//
+// Remembers the result of looking up a name in a directory,
+// so that path lookups of hot names skip the directory scan.
+// An entry maps (dev, directory inum, name) to the inum and
+// offset of the directory entry, or to inum 0 if the
+// directory has no such name.  Entries are changed only with
+// the directory locked, by dirlookup(), dirlink() and
+// sys_unlink(), so they always agree with the directory.
+// When a directory is freed, its entries are dropped, since
+// its inum may be reused.  A CLOCK hand picks the entry to
+// recycle, skipping ones used since its last pass.
+
+#define NDHASH  127
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory; 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if the name is not there
+  uint off;             // offset of the directory entry
+  int used;
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *bucket[NDHASH];
+  int hand;
+} dcache;
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Find the entry for name in dp.  Caller holds dcache.lock.
+static struct dentry*
+dcachefind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.bucket[dhash(dp->dev, dp->inum, name)]; d; d = d->next)
+    if(d->dinum == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Take d off its hash chain.  Caller holds dcache.lock.
+static void
+dcacheunlink(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.bucket[dhash(d->dev, d->dinum, d->name)]; *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dinum = 0;
+}
+
+// Look up name in dp.  Returns 1 and sets *inum and *off
+// if the cache knows the answer, 0 if not.
+static int
+dcachelookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcachefind(dp, name)) != 0){
+    d->used = 1;
+    *inum = d->inum;
+    *off = d->off;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Record that name in dp refers to inum, in the directory
+// entry at off; inum 0 means dp has no entry for name.
+// Caller must hold dp->lock.
+void
+dcacheset(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  int h;
+
+  acquire(&dcache.lock);
+  if((d = dcachefind(dp, name)) == 0){
+    for(;;){
+      d = &dcache.dentry[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDENTRY;
+      if(d->dinum == 0)
+        break;
+      if(!d->used){
+        dcacheunlink(d);
+        break;
+      }
+      d->used = 0;
+    }
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->next = dcache.bucket[h];
+    dcache.bucket[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = 1;
+  release(&dcache.lock);
+}
+
+// Drop the entries for directory dp, which is being freed.
+static void
+dcachepurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++)
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      dcacheunlink(d);
+  release(&dcache.lock);
+}
+
+#define NDIRENT  (BSIZE / sizeof(struct dirent))
+
+// The bucket of a hashed directory that name belongs in.
+static int
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDIRHASH;
+}
+
+// Return the first block of name's bucket in directory dp,
+// 0 if the bucket is empty, or -1 if dp is not hashed.
+// "." and ".." are not in any bucket: they are always the
+// first two dirents.
+static int
+dirbucket(struct inode *dp, char *name)
+{
+  struct buf *bp;
+  ushort *u;
+  int b;
+
+  if(dp->size < BSIZE || namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return -1;
+  bp = bread(dp->dev, bmap(dp, 0));
+  u = (ushort*)bp->data;
+  // The magic is in the name of the third dirent, whose inum a
+  // hashed directory leaves 0; a linear directory's third entry
+  // could be named to look like the magic.
+  if(((struct dirent*)bp->data)[2].inum == 0 && u[DIRHEAD(-1)] == DIRMAGIC)
+    b = u[DIRHEAD(dirhash(name))];
+  else
+    b = -1;
+  brelse(bp);
+  return b;
+}
+
+// Look for name in dp without the cache.  Returns the inum of
+// the entry and sets *poff to its offset, or returns 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
+{
+  uint off, inum;
+  struct dirent de, *d;
+  struct buf *bp;
+  int b, next, i;
+
+  // A hashed directory: look through name's bucket.
+  if((b = dirbucket(dp, name)) >= 0){
+    for(; b != 0; b = next){
+      bp = bread(dp->dev, bmap(dp, b));
+      d = (struct dirent*)bp->data;
+      for(i = 1; i < NDIRENT; i++)
+        if(d[i].inum != 0 && namecmp(name, d[i].name) == 0)
+          break;
+      inum = i < NDIRENT ? d[i].inum : 0;
+      next = ((ushort*)bp->data)[DIRNEXT];
+      brelse(bp);
+      if(inum){
+        *poff = b*BSIZE + i*sizeof(de);
+        return inum;
+      }
+    }
+    return 0;
+  }
+
+  for(off = 0; off < dp->size; off += sizeof(de)){
+    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirlookup read");
+    if(de.inum == 0)
+      continue;
+    if(namecmp(name, de.name) == 0){
+      // entry matches path element
+      *poff = off;
+      return de.inum;
+    }
+  }
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct dirent de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
+  if(!dcachelookup(dp, name, &inum, &off)){
+    off = 0;
+    inum = dirfind(dp, name, &off);
+    dcacheset(dp, name, inum, off);
+  }
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
+}
+
+// Add a zeroed block to the end of directory dp
+// and return its number.
+static int
+dirgrow(struct inode *dp)
+{
+  int b;
+
+  b = dp->size / BSIZE;
+  bmap(dp, b);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return b;
+}
+
+// Put (name, inum) in a free dirent of name's bucket in the
+// hashed directory dp, and return the dirent's offset.
+// Buckets share blocks until they fill up: a full block that
+// several buckets use is split in two, and a full chain of
+// one bucket (or one that a split did not help) gets another
+// block added to it.
+static uint
+dirinsert(struct inode *dp, char *name, uint inum)
+{
+  struct buf *b0, *bp, *nbp;
+  struct dirent *d, *nd;
+  ushort *u;
+  int h, k, lo, hi, mid, b, nb, i, j, split;
+
+  h = dirhash(name);
+  split = 0;
+  for(;;){
+    b0 = bread(dp->dev, bmap(dp, 0));
+    u = (ushort*)b0->data;
+    if(u[DIRHEAD(h)] == 0){
+      // No buckets yet: they all start out in one block.
+      nb = dirgrow(dp);
+      for(i = 0; i < NDIRHASH; i++)
+        u[DIRHEAD(i)] = nb;
+      log_write(b0);
+      brelse(b0);
       continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
     }
+
+    // Look for a free dirent in the bucket's chain.
+    b = u[DIRHEAD(h)];
+    bp = bread(dp->dev, bmap(dp, b));
+    for(;;){
+      d = (struct dirent*)bp->data;
+      for(i = 1; i < NDIRENT; i++)
+        if(d[i].inum == 0)
+          goto found;
+      if((nb = ((ushort*)bp->data)[DIRNEXT]) == 0)
+        break;
+      brelse(bp);
+      b = nb;
+      bp = bread(dp->dev, bmap(dp, b));
+    }
+
+    // The buckets that share block b.
+    for(lo = h; lo > 0 && u[DIRHEAD(lo-1)] == b; lo--)
+      ;
+    for(hi = h+1; hi < NDIRHASH && u[DIRHEAD(hi)] == b; hi++)
+      ;
+    if(split || hi - lo < 2 || b != u[DIRHEAD(h)])
+      break;
+
+    // Move the upper half of the buckets to a new block.
+    mid = (lo + hi) / 2;
+    nb = dirgrow(dp);
+    nbp = bread(dp->dev, bmap(dp, nb));
+    nd = (struct dirent*)nbp->data;
+    for(i = mid; i < hi; i++)
+      u[DIRHEAD(i)] = nb;
+    for(i = 1, j = 1; i < NDIRENT; i++){
+      k = dirhash(d[i].name);
+      if(k >= mid && k < hi){
+        nd[j] = d[i];
+        memset(&d[i], 0, sizeof(d[i]));
+        dcacheset(dp, nd[j].name, nd[j].inum, nb*BSIZE + j*sizeof(*d));
+        j++;
+      }
+    }
+    log_write(nbp);
+    brelse(nbp);
+    log_write(bp);
+    brelse(bp);
+    log_write(b0);
+    brelse(b0);
+    split = 1;
   }
 
-  return 0;
+  // Add a block to the end of the chain.
+  nb = dirgrow(dp);
+  ((ushort*)bp->data)[DIRNEXT] = nb;
+  log_write(bp);
+  brelse(bp);
+  b = nb;
+  bp = bread(dp->dev, bmap(dp, b));
+  d = (struct dirent*)bp->data;
+  i = 1;
+
+found:
+  brelse(b0);
+  strncpy(d[i].name, name, DIRSIZ);
+  d[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  return b*BSIZE + i*sizeof(*d);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -554,6 +1281,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -561,6 +1289,23 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  // A new directory starts out hashed, with an empty block 0
+  // but for the magic number.
+  if(dp->size == 0){
+    bp = bread(dp->dev, bmap(dp, 0));
+    ((ushort*)bp->data)[DIRHEAD(-1)] = DIRMAGIC;
+    log_write(bp);
+    brelse(bp);
+    dp->size = BSIZE;
+    iupdate(dp);
+  }
+
+  if(dirbucket(dp, name) >= 0){
+    off = dirinsert(dp, name, inum);
+    dcacheset(dp, name, inum, off);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -573,6 +1318,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheset(dp, name, inum, off);
 
   return 0;
 }
@@ -8,6 +8,11 @@
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
+// or, if the super block has the FS_GROUPS feature,
+// [ boot block | super block | log | group 0 | group 1 | ... ]
+// where each group of groupsize blocks (the last may be short) is
+// [ free bit map block | ipg inodes | data blocks ]
+// and the free map block describes the blocks of its own group.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,11 +24,19 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint features;     // FS_ flags; 0 on older file systems
+  uint groupstart;   // FS_GROUPS: block number of group 0
+  uint groupsize;    // FS_GROUPS: blocks per group, at most BPB
+  uint ngroups;      // FS_GROUPS: number of groups
+  uint ipg;          // FS_GROUPS: inodes per group, a multiple of IPB
 };
 
-#define NDIRECT 12
+#define FS_GROUPS 0x1  // disk is divided into block groups
+
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,20 +45,33 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
+// First block of group g, the group holding block b,
+// and the group holding inode i
+#define GSTART(g, sb)     ((sb).groupstart + (g)*(sb).groupsize)
+#define BGROUP(b, sb)     (((b) - (sb).groupstart) / (sb).groupsize)
+#define IGROUP(i, sb)     ((i) / (sb).ipg)
+
+// First data block of group g
+#define GDATA(g, sb)      (GSTART(g, sb) + 1 + (sb).ipg/IPB)
+
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     ((sb).features & FS_GROUPS ? \
+  GSTART(IGROUP(i, sb), sb) + 1 + (i) % (sb).ipg / IPB : (i) / IPB + (sb).inodestart)
 
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
-// Block of free map containing bit for block b
-#define BBLOCK(b, sb) (b/BPB + sb.bmapstart)
+// Block of free map containing bit for block b, and which bit
+#define BBLOCK(b, sb) ((sb).features & FS_GROUPS ? \
+  GSTART(BGROUP(b, sb), sb) : (b)/BPB + (sb).bmapstart)
+#define BBIT(b, sb)   ((sb).features & FS_GROUPS ? \
+  ((b) - (sb).groupstart) % (sb).groupsize : (b) % BPB)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -55,3 +81,20 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Hashed directories.  Block 0 holds "." and ".." and, in the
+// rest of the block, the first directory block of each of
+// NDIRHASH buckets.  A name belongs in bucket dirhash(name):
+//   h = h*31 + c for each char c of the name, mod NDIRHASH.
+// A bucket is a chain of blocks, each linked to the next by
+// the ushort after its first dirent's inum; neighbouring
+// buckets may share their blocks.  Block numbers
+// are kept where dirent names would be, in dirents with
+// inum 0, so code that reads every dirent skips them.
+#define DIRMAGIC  0x4448  // in block 0 of a hashed directory
+#define NDIRHASH  209     // 7 ushorts in each of 30 dirents, less the magic
+
+// Index of the ushort in block 0 that holds bucket h's first
+// block; h = -1 gives DIRMAGIC's.
+#define DIRHEAD(h)  (16 + ((h)+1)/7*8 + 1 + ((h)+1)%7)
+#define DIRNEXT     1     // ushort in a bucket block: the next one
+
@@ -1,17 +1,21 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code.  Uses bus-master DMA when the disk sits
+// behind a PCI IDE controller that supports it (like QEMU's
+// PIIX), and multi-sector PIO otherwise.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,15 +27,48 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+#define IDE_MAXSECT   128  // most sectors in one command
+#define IDE_MULT      16   // sectors per interrupt for PIO multiple
+
+// Bus master registers, from the controller's BAR4.
+#define BM_CMD        0     // command
+#define BM_STATUS     2     // status
+#define BM_PRDT       4     // physical address of PRD table
+#define BM_START      0x01  // BM_CMD: start transfer
+#define BM_READ       0x08  // BM_CMD: transfer from disk to memory
+#define BM_ERR        0x02  // BM_STATUS: error (write 1 to clear)
+#define BM_INTR       0x04  // BM_STATUS: interrupt (write 1 to clear)
+
+// Physical region descriptor: one piece of memory to transfer.
+struct prd {
+  uint addr;
+  ushort count;           // bytes
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last entry in table
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// idequeue points to the command the disk is working on: a chain
+// of bufs for consecutive blocks from ioqnext(), linked by qnext.
+// idesect counts the sectors of idequeue done so far, and
+// ideleft the sectors of the command still to go.  Requests
+// waiting their turn are kept by iosched.c.
 // You must hold idelock while manipulating queue.
 
+int ideirq = IRQ_IDE;
+
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idesect;
+static int ideleft;
 
 static int havedisk1;
+static int idemult;       // sectors per PIO interrupt
+static ushort bmiba;      // bus master I/O base, or 0 for PIO
+static struct prd *prdt;  // DMA PRD table
 static void idestart(struct buf*);
 
 // Wait for IDE disk to become ready.
@@ -47,12 +84,50 @@ idewait(int checkerr)
   return 0;
 }
 
+// Look for a PCI IDE controller that can do bus-master DMA
+// for the primary channel, and get it ready.
+static void
+idedmainit(void)
+{
+  uint tag, bar;
+
+  if(pcifind(-1, -1, 0x01, 0x01, &tag) < 0)
+    return;
+  if((pciread(tag, PCI_CLASS) & 0x8000) == 0)  // prog if bit 7
+    return;
+  bar = pciread(tag, PCI_BAR0 + 4*4);
+  if((bar & 1) == 0 || (bar & 0xFFFC) == 0)
+    return;
+  if((prdt = (struct prd*)kalloc()) == 0)
+    return;
+  pciwrite(tag, PCI_CMD, pciread(tag, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MASTER);
+  bmiba = bar & 0xFFFC;
+}
+
+// Ask disk dev for IDE_MULT sectors per PIO interrupt.
+// Returns 0 on success, -1 if it refuses.
+static int
+idesetmult(int dev)
+{
+  int r;
+
+  outb(0x3f6, 2);  // no interrupt for this command
+  outb(0x1f6, 0xe0 | ((dev&1)<<4));
+  idewait(0);
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  r = idewait(1);
+  outb(0x3f6, 0);
+  return r;
+}
+
 void
 ideinit(void)
 {
   int i;
 
   initlock(&idelock, "ide");
+  ioschedinit();
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -67,35 +142,112 @@ ideinit(void)
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  idedmainit();
+  idemult = 1;
+  if(bmiba == 0 && idesetmult(0) == 0 && (!havedisk1 || idesetmult(1) == 0))
+    idemult = IDE_MULT;
+  outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Move the next n sectors of the command between the disk and
+// the bufs, starting at sector idesect of idequeue.
+static void
+idepio(int n)
+{
+  struct buf *b;
+  int s;
+
+  b = idequeue;
+  for(s = idesect; n > 0; n--){
+    if(b->flags & B_DIRTY)
+      outsl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+    if(++s == BSIZE/SECTOR_SIZE){
+      s = 0;
+      b = b->qnext;
+    }
+  }
+}
+
+// Start the command for the chain of bufs b.
+// Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *p;
+  int n, write;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  for(n = 1, p = b; p->qnext; n++, p = p->qnext)
+    ;
+  if(p->blockno >= FSSIZE)
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7) panic("idestart");
+  if (n * sector_per_block > IDE_MAXSECT) panic("idestart: too long");
 
+  idesect = 0;
+  ideleft = n * sector_per_block;
+  write = b->flags & B_DIRTY;
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, ideleft);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+
+  if(bmiba){
+    // One PRD per buf; the disk interrupts once at the end.
+    for(n = 0, p = b; p; n++, p = p->qnext){
+      prdt[n].addr = V2P(p->data);
+      prdt[n].count = BSIZE;
+      prdt[n].flags = 0;
+    }
+    prdt[n-1].flags = PRD_EOT;
+    outb(bmiba + BM_CMD, 0);
+    outl(bmiba + BM_PRDT, V2P(prdt));
+    outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_ERR | BM_INTR);
+    outb(0x1f7, write ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(bmiba + BM_CMD, (write ? 0 : BM_READ) | BM_START);
+  } else if(write){
+    // The disk interrupts after each idemult sectors.
+    outb(0x1f7, idemult > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE);
+    idepio(ideleft < idemult ? ideleft : idemult);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, idemult > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ);
+  }
+}
+
+// Count n more sectors of the command as done, and finish the
+// bufs they complete.  Bufs with an iodone callback are put on
+// *done, for the caller to call once it has released idelock.
+static void
+idefinish(int n, struct buf **done)
+{
+  struct buf *b;
+
+  ideleft -= n;
+  idesect += n;
+  while(idequeue && idesect >= BSIZE/SECTOR_SIZE){
+    b = idequeue;
+    idequeue = b->qnext;
+    idesect -= BSIZE/SECTOR_SIZE;
+    ioqdone(b);
+
+    // Wake process waiting for this buf.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->iodone){
+      b->qnext = *done;
+      *done = b;
+    }
   }
 }
 
@@ -103,66 +255,95 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *done, *next;
+  void (*fn)(struct buf*);
+  int n;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
   if((b = idequeue) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  done = 0;
+  if(bmiba){
+    // The whole command is done.
+    outb(bmiba + BM_CMD, 0);
+    outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_ERR | BM_INTR);
+    idewait(0);
+    idefinish(ideleft, &done);
+  } else {
+    // Another idemult sectors are done; read them if needed.
+    n = ideleft < idemult ? ideleft : idemult;
+    if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
+      idepio(n);
+    idefinish(n, &done);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Send the next sectors to write.
+    if(ideleft > 0 && (idequeue->flags & B_DIRTY)){
+      idewait(0);
+      idepio(ideleft < idemult ? ideleft : idemult);
+    }
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
+  // Start disk on next command in queue.
+  if(ideleft == 0 && (idequeue = ioqnext(IDE_MAXSECT / (BSIZE/SECTOR_SIZE))) != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  // Nobody waits for a buf with a callback, so it is safe
+  // to use them after releasing idelock.
+  for(b = done; b; b = next){
+    next = b->qnext;
+    fn = b->iodone;
+    b->iodone = 0;
+    fn(b);
+  }
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
+// Start syncing buf with disk, without waiting for it.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// When the request is done, ideintr calls b->iodone(b), if set.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    panic("idesubmit: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  ioqadd(b);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idequeue == 0 && (idequeue = ioqnext(IDE_MAXSECT / (BSIZE/SECTOR_SIZE))) != 0)
+    idestart(idequeue);
 
-  // Wait for request to finish.
+  release(&idelock);
+}
+
+// Wait for the request for b started by idesubmit to finish.
+void
+idewaitbuf(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-
   release(&idelock);
 }
+
+// Sync buf with disk and wait for it.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  idewaitbuf(b);
+}
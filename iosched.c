@@ -0,0 +1,236 @@
+// Disk request scheduling.
+//
+// The disk driver hands each buf it is asked to read or write
+// to ioqadd(), and when the disk is free asks ioqnext() for the
+// next command: a chain of bufs for consecutive blocks, all
+// reads or all writes, linked through qnext.  Which request goes
+// first depends on the policy, chosen at boot with IOSCHED in
+// the Makefile and changed with setiosched():
+// * noop: oldest request first.
+// * elevator: C-SCAN.  The lowest block at or after where the
+//     disk head was left, wrapping around to the lowest block.
+// * deadline: C-SCAN, except that a read queued for more than
+//     READEXPIRE ticks, or a write for more than WRITEEXPIRE,
+//     goes first.
+//
+// ioq.lock protects the queue, the policy and the counters.
+// The driver calls in holding its own lock, which must be
+// taken first.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "iostat.h"
+
+#define READEXPIRE   5
+#define WRITEEXPIRE  50
+
+static char *names[NIOSCHED] = {
+[IOSCHED_NOOP]      "noop",
+[IOSCHED_ELEVATOR]  "elevator",
+[IOSCHED_DEADLINE]  "deadline",
+};
+
+static struct {
+  struct spinlock lock;
+  int sched;
+  struct buf *head;     // pending requests in the order they came
+  struct buf *tail;
+  uint pos;             // block after the last one dispatched
+  uint64 mark;          // last time the disk started or finished a block
+  struct iostat st;
+} ioq;
+
+void
+ioschedinit(void)
+{
+  int i;
+
+  for(i = 0; i < NIOSCHED; i++)
+    if(strncmp(IOSCHED, names[i], 16) == 0)
+      break;
+  if(i == NIOSCHED)
+    panic("ioschedinit: unknown IOSCHED");
+  initlock(&ioq.lock, "ioq");
+  ioq.sched = i;
+}
+
+// Queue b.
+void
+ioqadd(struct buf *b)
+{
+  acquire(&ioq.lock);
+  b->qtime = rdtsc();
+  b->qnext = 0;
+  if(ioq.head == 0)
+    ioq.head = b;
+  else
+    ioq.tail->qnext = b;
+  ioq.tail = b;
+  release(&ioq.lock);
+}
+
+// Take the buf at *pp off the pending list.
+static struct buf*
+unqueue(struct buf **pp, struct buf *prev)
+{
+  struct buf *b;
+
+  b = *pp;
+  *pp = b->qnext;
+  if(ioq.tail == b)
+    ioq.tail = prev;
+  b->qnext = 0;
+  return b;
+}
+
+// Link to the request C-SCAN would start next.
+static struct buf**
+cscan(struct buf **prevp)
+{
+  struct buf **pp, **best, **low, *prev, *bprev, *lprev;
+
+  best = low = 0;
+  bprev = lprev = 0;
+  prev = 0;
+  for(pp = &ioq.head; *pp; prev = *pp, pp = &(*pp)->qnext){
+    if(low == 0 || (*pp)->blockno < (*low)->blockno){
+      low = pp;
+      lprev = prev;
+    }
+    if((*pp)->blockno >= ioq.pos &&
+       (best == 0 || (*pp)->blockno < (*best)->blockno)){
+      best = pp;
+      bprev = prev;
+    }
+  }
+  if(best == 0){
+    best = low;
+    bprev = lprev;
+  }
+  *prevp = bprev;
+  return best;
+}
+
+// Link to the oldest request that has waited past its
+// deadline, or 0 if none has.
+static struct buf**
+expired(struct buf **prevp)
+{
+  struct buf **pp, *prev;
+  uint64 now;
+  uint limit;
+
+  now = rdtsc();
+  prev = 0;
+  for(pp = &ioq.head; *pp; prev = *pp, pp = &(*pp)->qnext){
+    limit = ((*pp)->flags & B_DIRTY) ? WRITEEXPIRE : READEXPIRE;
+    if(tscruntime(now - (*pp)->qtime) >= limit*1000){
+      *prevp = prev;
+      return pp;
+    }
+  }
+  return 0;
+}
+
+// Remove the next command from the queue: the policy's choice
+// of request, followed by queued requests for the blocks right
+// after it, in the same direction, up to max in all.
+// Returns 0 if nothing is queued.
+struct buf*
+ioqnext(int max)
+{
+  struct buf **pp, *prev, *b, *last;
+  int n;
+
+  acquire(&ioq.lock);
+  if(ioq.head == 0){
+    release(&ioq.lock);
+    return 0;
+  }
+
+  prev = 0;
+  pp = &ioq.head;
+  if(ioq.sched == IOSCHED_ELEVATOR)
+    pp = cscan(&prev);
+  else if(ioq.sched == IOSCHED_DEADLINE && (pp = expired(&prev)) == 0)
+    pp = cscan(&prev);
+  b = last = unqueue(pp, prev);
+
+  for(n = 1; n < max; n++){
+    prev = 0;
+    for(pp = &ioq.head; *pp; prev = *pp, pp = &(*pp)->qnext)
+      if((*pp)->dev == b->dev && (*pp)->blockno == last->blockno + 1 &&
+         ((*pp)->flags & B_DIRTY) == (b->flags & B_DIRTY))
+        break;
+    if(*pp == 0)
+      break;
+    last->qnext = unqueue(pp, prev);
+    last = last->qnext;
+  }
+
+  ioq.pos = last->blockno + 1;
+  ioq.mark = rdtsc();
+  ioq.st.policy[ioq.sched].commands++;
+  release(&ioq.lock);
+  return b;
+}
+
+// Account for the disk finishing b, from a chain ioqnext()
+// returned.
+void
+ioqdone(struct buf *b)
+{
+  uint64 now;
+  uint lat;
+
+  acquire(&ioq.lock);
+  now = rdtsc();
+  lat = tscruntime(now - b->qtime);
+  if(b->flags & B_DIRTY)
+    ioq.st.policy[ioq.sched].writes++;
+  else
+    ioq.st.policy[ioq.sched].reads++;
+  ioq.st.policy[ioq.sched].totallat += lat;
+  if(lat > ioq.st.policy[ioq.sched].maxlat)
+    ioq.st.policy[ioq.sched].maxlat = lat;
+  ioq.st.policy[ioq.sched].busy += tscruntime(now - ioq.mark);
+  ioq.mark = now;
+  release(&ioq.lock);
+}
+
+// Switch to scheduling policy sched.  Returns the old
+// policy, or -1 if sched is not one.
+int
+setiosched(int sched)
+{
+  int old;
+
+  if(sched < 0 || sched >= NIOSCHED)
+    return -1;
+  acquire(&ioq.lock);
+  old = ioq.sched;
+  ioq.sched = sched;
+  release(&ioq.lock);
+  return old;
+}
+
+// Fill in the policy in use and each policy's counters.
+// They are copied under the lock first, since st may be
+// user memory that faults on the way in.
+void
+iostat(struct iostat *st)
+{
+  struct iostat s;
+
+  acquire(&ioq.lock);
+  s = ioq.st;
+  s.sched = ioq.sched;
+  release(&ioq.lock);
+  *st = s;
+}
@@ -0,0 +1,19 @@
+// Disk scheduling policies, for setiosched().
+#define IOSCHED_NOOP      0   // first come, first served
+#define IOSCHED_ELEVATOR  1   // C-SCAN by block number
+#define IOSCHED_DEADLINE  2   // C-SCAN, but old requests go first
+#define NIOSCHED          3
+
+// Disk statistics reported by iostat().  Times are in
+// thousandths of a clock tick.
+struct iostat {
+  int sched;          // policy in use
+  struct {
+    uint reads;       // blocks read
+    uint writes;      // blocks written
+    uint commands;    // disk commands, after merging
+    uint busy;        // time the disk was working
+    uint totallat;    // sum over blocks of time from queueing to done
+    uint maxlat;      // longest such time
+  } policy[NIOSCHED]; // counted while each policy was in use
+};
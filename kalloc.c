@@ -7,8 +7,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
 #include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
+#include "memstat.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -22,13 +25,34 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  // Number of page tables (or other users) holding each physical
+  // page, so that fork() can share pages copy-on-write.
+  // Updated with atomic instructions, not under lock.
+  uint ref[PHYSTOP / PGSIZE];
+  uchar use[PHYSTOP / PGSIZE];  // MS_* category of each allocated page
+  uint nr[NMEMSTAT];            // pages in each category, kept with xadd
 } kmem;
 
+// Each cpu keeps a small stack of free pages of its own, so
+// that most kalloc() and kfree() calls touch no shared lock.
+// A cache is refilled from or drained to kmem.freelist
+// KBATCH pages at a time.  Only its own cpu touches it, with
+// interrupts off.
+#define KCACHE  64      // most pages a cpu keeps
+#define KBATCH  32      // pages moved to or from kmem at once
+
+struct kcache {
+  struct run *freelist;
+  int n;
+} kcache[NCPU];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until kinit2() finishes, cpuid() is not usable yet, so pages go
+// straight to and from kmem.freelist.
 void
 kinit1(void *vstart, void *vend)
 {
@@ -49,32 +73,94 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    // Count the page as an allocated kernel page that kfree() gives back.
+    kmem.ref[V2P(p) / PGSIZE] = 1;
+    kmem.use[V2P(p) / PGSIZE] = MS_KERNEL;
+    kmem.nr[MS_KERNEL]++;
     kfree(p);
+  }
 }
+
+// Move up to KBATCH pages from kmem.freelist to cache c.
+static void
+refill(struct kcache *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < KBATCH && (r = kmem.freelist) != 0; i++){
+    kmem.freelist = r->next;
+    r->next = c->freelist;
+    c->freelist = r;
+    c->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Give KBATCH pages from cache c back to kmem.freelist.
+static void
+drain(struct kcache *c)
+{
+  struct run *first, *last;
+  int i;
+
+  first = last = c->freelist;
+  for(i = 1; i < KBATCH; i++)
+    last = last->next;
+  c->freelist = last->next;
+  c->n -= KBATCH;
+
+  acquire(&kmem.lock);
+  last->next = kmem.freelist;
+  kmem.freelist = first;
+  release(&kmem.lock);
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, and free it if that was the last one.  v normally
+// should have been returned by a call to kalloc().
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(char *v)
 {
+  struct kcache *c;
   struct run *r;
+  uint ref;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  ref = xadd(&kmem.ref[V2P(v) / PGSIZE], -1);
+  if(ref == 0)
+    panic("kfree: page is free");
+  if(ref > 1)
+    return;     // still mapped elsewhere
+  xadd(&kmem.nr[kmem.use[V2P(v) / PGSIZE]], -1);
+  xadd(&kmem.nr[MS_FREE], 1);
+
+#ifndef NOJUNK
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    return;
+  }
+
+  pushcli();
+  c = &kcache[cpuid()];
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n > KCACHE)
+    drain(c);
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,26 +169,86 @@ kfree(char *v)
 char*
 kalloc(void)
 {
+  struct kcache *c;
   struct run *r;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    if((r = kmem.freelist) != 0)
+      kmem.freelist = r->next;
+  } else {
+    pushcli();
+    c = &kcache[cpuid()];
+    if(c->n == 0)
+      refill(c);
+    if((r = c->freelist) != 0){
+      c->freelist = r->next;
+      c->n--;
+    }
+    popcli();
+    // Out of memory: ask the disk block cache for some back.
+    if(r == 0 && bshrink())
+      return kalloc();
+  }
+  if(r){
+    kmem.ref[V2P(r) / PGSIZE] = 1;
+    kmem.use[V2P(r) / PGSIZE] = MS_KERNEL;
+    xadd(&kmem.nr[MS_FREE], -1);
+    xadd(&kmem.nr[MS_KERNEL], 1);
+  }
   return (char*)r;
 }
 
+// Record what the allocated page at v is used for (MS_*),
+// for memstat().  kalloc() counts every page as MS_KERNEL
+// until told otherwise.
+void
+ksetuse(char *v, int use)
+{
+  int old;
+
+  old = kmem.use[V2P(v) / PGSIZE];
+  kmem.use[V2P(v) / PGSIZE] = use;
+  xadd(&kmem.nr[old], -1);
+  xadd(&kmem.nr[use], 1);
+}
+
+// What the allocated page at v is used for.
+int
+kgetuse(char *v)
+{
+  return kmem.use[V2P(v) / PGSIZE];
+}
+
+// Take another reference to the allocated page at v.
+void
+kincref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kincref");
+
+  xadd(&kmem.ref[V2P(v) / PGSIZE], 1);
+}
+
+// Number of references to the allocated page at v.
+int
+krefcount(char *v)
+{
+  return kmem.ref[V2P(v) / PGSIZE];
+}
+
 // Returns the current number of free memory pages
 int
-freemem(void) {
-  int free_memory_pages = 0;
-  struct run *r = kmem.freelist;
-  while (r != 0) {
-    free_memory_pages++;
-    r = r->next;
-  }
-  return free_memory_pages;
+freemem(void)
+{
+  return kmem.nr[MS_FREE];
+}
+
+// Fill in the number of pages in each category.
+void
+memstat(struct memstat *ms)
+{
+  int i;
+
+  for(i = 0; i < NMEMSTAT; i++)
+    ms->pages[i] = kmem.nr[i];
 }
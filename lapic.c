@@ -31,7 +31,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
-  #define PERIODIC   0x00020000   // Periodic
+  #define PERIODIC   0x00020000   // Periodic (else one-shot)
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
@@ -43,6 +43,16 @@
 
 volatile uint *lapic;  // Initialized in mp.c
 
+// Timer counts between clock ticks.
+#define TICKCOUNT 10000000
+
+// Process runtime is measured in 1/1000ths of a clock tick.
+// tsc_per_tick is calibrated against the timer in lapicinit(),
+// and tsc_mult is (1000 << 32) / tsc_per_tick, so that converting
+// TSC cycles to runtime is a multiply and a shift.
+static uint tsc_per_tick;
+static uint tsc_mult;
+
 //PAGEBREAK!
 static void
 lapicw(int index, int value)
@@ -51,6 +61,66 @@ lapicw(int index, int value)
   lapic[ID];  // wait for write to finish, by reading
 }
 
+// Count TSC cycles over a tenth of a tick of the (masked)
+// timer counting down in one-shot mode.
+static void
+tsccalibrate(void)
+{
+  uint64 t0, t1;
+  uint rem;
+
+  lapicw(TIMER, MASKED);
+  lapicw(TICR, 0xFFFFFFFF);
+  t0 = rdtsc();
+  while(lapic[TCCR] > 0xFFFFFFFF - TICKCOUNT/10)
+    ;
+  t1 = rdtsc();
+  lapicw(TICR, 0);
+
+  tsc_per_tick = (uint)(t1 - t0) * 10;
+  if(tsc_per_tick <= 1000)
+    tsc_per_tick = 1001;  // keep the quotient below in 32 bits
+  // edx:eax = 1000 << 32
+  asm volatile("divl %2" : "=a" (tsc_mult), "=d" (rem)
+               : "rm" (tsc_per_tick), "a" (0), "d" (1000));
+}
+
+// Convert TSC cycles to runtime (1000 per clock tick).
+uint
+tscruntime(uint64 cycles)
+{
+  if(cycles >> 32)
+    cycles = 0xFFFFFFFF;
+  return (cycles * tsc_mult) >> 32;
+}
+
+// Interrupt this cpu once, after the given runtime
+// (1000 per clock tick). 0 stops the timer.
+void
+lapiconeshot(uint runtime)
+{
+  if(!lapic)
+    return;
+  if(runtime > 0xFFFFFFFF / (TICKCOUNT/1000))
+    runtime = 0xFFFFFFFF / (TICKCOUNT/1000);
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, runtime * (TICKCOUNT/1000));
+}
+
+// Send interrupt vector to the cpu with the given APIC ID.
+void
+lapicipi(int apicid, int vector)
+{
+  if(!lapic)
+    return;
+  pushcli();
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+  popcli();
+}
+
 void
 lapicinit(void)
 {
@@ -65,8 +135,10 @@ lapicinit(void)
   // If xv6 cared more about precise timekeeping,
   // TICR would be calibrated using an external time source.
   lapicw(TDCR, X1);
+  if(tsc_per_tick == 0)
+    tsccalibrate();
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TICR, TICKCOUNT);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
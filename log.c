@@ -1,7 +1,10 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -9,25 +12,38 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
+// calls. A transaction is only closed when there are
 // no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
+// A system call should call begin_opn()/end_op() to mark
+// its start and end, passing the most blocks it can write
+// (begin_op() reserves MAXOPBLOCKS). Usually begin_opn()
+// just increments the count of in-progress FS system calls,
+// reserves that many log blocks for it, and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the commit thread has made room.
+//
+// Commits are done by a kernel thread, logcommit(), so that
+// end_op() need not wait for the disk.  Once the last
+// outstanding operation ends, the thread closes the running
+// transaction by copying its blocks into their log slots, and
+// system calls can start filling the next transaction while
+// it writes those slots and the header to disk.
 //
 // The log is a physical re-do log containing disk blocks.
+// Committed transactions are appended to the log one after
+// another, and are only installed to their home locations
+// (a checkpoint) once the log is full, so a block written by
+// many transactions is installed once.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A block may appear more than once; the last copy wins.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -41,14 +57,17 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by them.
+  int closing;     // logcommit() is closing the transaction, please wait.
+  int full;        // begin_op() is waiting for log space.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the running transaction
+  struct logheader ch;  // blocks in the log, committed or being committed
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logcommit(void);
 
 void
 initlog(int dev)
@@ -62,22 +81,42 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  if (log.size - 1 > LOGSIZE)
+    panic("initlog: log too big");
   recover_from_log();
+  kthread("logcommit", logcommit);
 }
 
-// Copy committed blocks from log to their home location
+// Copy the blocks in the log to their home location.
+// When recovering, the data comes from the log blocks;
+// otherwise the cached home blocks are already up to date,
+// and are still pinned by B_DIRTY until written.
 static void
-install_trans(void)
+install_trans(int recovering)
 {
-  int tail;
+  int tail, i, n;
+  struct buf *dbuf[LOGSIZE];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  // Start all the writes, then wait for them, so the disk
+  // always has the next one queued.
+  n = 0;
+  for (tail = 0; tail < log.ch.n; tail++) {
+    for (i = tail+1; i < log.ch.n; i++)
+      if (log.ch.block[i] == log.ch.block[tail])
+        break;
+    if (i < log.ch.n)
+      continue;  // a later copy of the same block wins
+    dbuf[n] = bread(log.dev, log.ch.block[tail]); // read dst
+    if (recovering) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      memmove(dbuf[n]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bsubmit(dbuf[n++]);  // write dst to disk
+  }
+  for (i = 0; i < n; i++) {
+    bwait(dbuf[i]);
+    brelse(dbuf[i]);
   }
 }
 
@@ -88,25 +127,25 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.ch.n = lh->n;
+  for (i = 0; i < log.ch.n; i++) {
+    log.ch.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write the first n blocks of the in-memory log header to disk.
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(int n)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = n;
+  for (i = 0; i < n; i++) {
+    hb->block[i] = log.ch.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,24 +155,39 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  install_trans(1); // if committed, copy from log to disk
+  log.ch.n = 0;
+  write_head(0); // clear the log
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that
+// writes at most n blocks.
+void
+begin_opn(int n)
+{
+  if(n > log.size-1)
+    panic("begin_opn: too big");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.ch.n + log.lh.n + log.reserved + n > log.size-1){
+      // this op might exhaust log space; wait for a checkpoint.
+      log.full = 1;
+      wakeup(&log.ch);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
@@ -141,69 +195,123 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets logcommit() close the transaction if this was
+// the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.reserved -= myproc()->logres;
+  if(log.outstanding == 0)
+    wakeup(&log.ch);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+// The most blocks one FS system call should reserve, so that
+// a few large ones can share the log.
+int
+log_maxop(void)
+{
+  return (log.size-1) / 2;
 }
 
-// Copy modified blocks from cache to log.
+// Copy the running transaction's blocks from cache to their
+// slots in the log, after the n blocks already there.
+// to[] gets the locked log blocks, ready to be written.
+// No FS system call may be active.
 static void
-write_log(void)
+copy_log(int n, struct buf **to)
 {
   int tail;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    to[tail] = bnew(log.dev, log.start+n+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    memmove(to[tail]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the n log blocks in to[] to disk.
+static void
+write_log(int n, struct buf **to)
+{
+  int tail;
+
+  // Start all the writes, then wait for them.
+  for (tail = 0; tail < n; tail++)
+    bsubmit(to[tail]);  // write the log
+  for (tail = 0; tail < n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
+  }
+}
+
+// The commit thread.  Closes the running transaction whenever
+// no FS system call is active, and writes it to the log while
+// the next transaction fills.  When begin_op() runs out of log
+// space, also installs the whole log, with FS system calls
+// held off so that the cached blocks match what is committed.
 static void
-commit()
+logcommit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  static struct buf *to[LOGSIZE];
+  int i, n, nlog, ckpt;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!log.full && (log.lh.n == 0 || log.outstanding > 0))
+      sleep(&log.ch, &log.lock);
+
+    // Stop new operations and wait for the running ones.
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log.ch, &log.lock);
+    ckpt = log.full;
+    nlog = log.ch.n;
+    n = log.lh.n;
+    release(&log.lock);
+
+    copy_log(nlog, to);
+
+    acquire(&log.lock);
+    for(i = 0; i < n; i++)
+      log.ch.block[nlog+i] = log.lh.block[i];
+    log.ch.n = nlog + n;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    if(!ckpt){
+      log.closing = 0;
+      wakeup(&log);
+    }
+    release(&log.lock);
+
+    if(n > 0){
+      write_log(n, to); // Write modified blocks from cache to log
+      write_head(nlog + n); // Write header to disk -- the real commit
+    }
+    if(ckpt){
+      install_trans(0); // Now install writes to home locations
+      write_head(0);    // Erase the transactions from the log
+    }
+
+    acquire(&log.lock);
+    if(ckpt){
+      log.ch.n = 0;
+      log.full = 0;
+      log.closing = 0;
+    }
+    wakeup(&log);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// logcommit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -215,12 +323,12 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  acquire(&log.lock);
+  if (log.ch.n + log.lh.n >= LOGSIZE || log.ch.n + log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  acquire(&log.lock);
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
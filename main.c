@@ -3,6 +3,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "x86.h"
 
@@ -5,16 +5,19 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
+int ideirq = IRQ_IDE;
+
 static int disksize;
 static uchar *memdisk;
 
@@ -35,19 +38,22 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// The memory disk is done at once, so b->iodone(b), if set,
+// is called before this returns.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
   uchar *p;
+  void (*done)(struct buf*);
 
   if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 1)
-    panic("iderw: request not for disk 1");
+    panic("idesubmit: request not for disk 1");
   if(b->blockno >= disksize)
-    panic("iderw: block out of range");
+    panic("idesubmit: block out of range");
 
   p = memdisk + b->blockno*BSIZE;
 
@@ -57,4 +63,20 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if((done = b->iodone) != 0){
+    b->iodone = 0;
+    done(b);
+  }
+}
+
+void
+idewaitbuf(struct buf *b)
+{
+  // no-op
+}
+
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
 }
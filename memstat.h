@@ -0,0 +1,14 @@
+// Categories of physical pages reported by memstat().
+#define MS_FREE      0   // free
+#define MS_PGTBL     1   // page directories and page tables
+#define MS_KSTACK    2   // kernel stacks
+#define MS_PIPE      3   // pipe buffers
+#define MS_MMAPFILE  4   // file-backed mmap pages
+#define MS_ANON      5   // process memory and anonymous mmap pages
+#define MS_BCACHE    6   // disk block cache
+#define MS_KERNEL    7   // anything else the kernel allocated
+#define NMEMSTAT     8
+
+struct memstat {
+  uint pages[NMEMSTAT];  // number of pages in each category
+};
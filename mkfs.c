@@ -16,24 +16,34 @@
 #endif
 
 #define NINODES 200
+#define GROUPSIZE 512  // blocks per group
 
-// Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// Disk layout (see fs.h):
+// [ boot block | sb block | log | group 0 | group 1 | ... ]
+// with each group [ free bit map | inode blocks | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nlog = FSSIZE/8 < LOGSIZE+1 ? FSSIZE/8 : LOGSIZE+1;  // header + data
+int ngroups;  // Number of block groups
+int ipg;      // Inodes per group
+int nmeta;    // Number of meta blocks (boot, sb, nlog, bitmap, inode)
 int nblocks;  // Number of data blocks
 
+#define NROOTBLOCKS 64
+
 int fsfd;
 struct superblock sb;
+ushort rootdir[NROOTBLOCKS*BSIZE/2];  // root directory contents
+uint rootblocks;                      // blocks in rootdir
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
 
-void balloc(int);
+uint newblock(void);
+void balloc(void);
+uint dirhash(char*);
+uint dirgrow(void);
+void dirinsert(char*, uint);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
@@ -68,10 +78,9 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum;
   struct dirent de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -91,21 +100,33 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  // Split the blocks after the log into groups, and the inodes
+  // evenly between them, a whole number of inode blocks each.
+  ngroups = (FSSIZE - (2+nlog) + GROUPSIZE - 1) / GROUPSIZE;
+  ipg = (NINODES + ngroups - 1) / ngroups;
+  ipg = (ipg + IPB - 1) / IPB * IPB;
+  nmeta = 2 + nlog + ngroups * (1 + ipg/IPB);
   nblocks = FSSIZE - nmeta;
+  assert(GROUPSIZE <= BPB);
 
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ngroups * ipg);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.inodestart = xint(2+nlog+1);
+  sb.bmapstart = xint(2+nlog);
+  sb.features = xint(FS_GROUPS);
+  sb.groupstart = xint(2+nlog);
+  sb.groupsize = xint(GROUPSIZE);
+  sb.ngroups = xint(ngroups);
+  sb.ipg = xint(ipg);
+  assert(GSTART(ngroups-1, sb) + 1 + ipg/IPB < FSSIZE);  // last group has data
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u, %d groups of %d blocks with bitmap and %d inode blocks) blocks %d total %d\n",
+         nmeta, nlog, ngroups, GROUPSIZE, (int)(ipg/IPB), nblocks, FSSIZE);
 
-  freeblock = nmeta;     // the first free block that we can allocate
+  freeblock = GDATA(0, sb);  // the first free block that we can allocate
 
   for(i = 0; i < FSSIZE; i++)
     wsect(i, zeroes);
@@ -117,15 +138,19 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
+  // Build the root directory, hashed, in rootdir.
+  rootdir[DIRHEAD(-1)] = xshort(DIRMAGIC);
+  rootblocks = 1;
+
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  memmove(rootdir, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  memmove((char*)rootdir + sizeof(de), &de, sizeof(de));
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -144,10 +169,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirinsert(argv[i], inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -155,14 +177,9 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  iappend(rootino, rootdir, rootblocks * BSIZE);
 
-  balloc(freeblock);
+  balloc();
 
   exit(0);
 }
@@ -226,6 +243,8 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < xint(sb.ninodes));
+
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -234,20 +253,119 @@ ialloc(ushort type)
   return inum;
 }
 
+// Allocate the next data block, stepping over the
+// bitmap and inodes at the start of each group.
+uint
+newblock(void)
+{
+  if(freeblock < GDATA(BGROUP(freeblock, sb), sb))
+    freeblock = GDATA(BGROUP(freeblock, sb), sb);
+  assert(freeblock < FSSIZE);
+  return freeblock++;
+}
+
+// Write each group's bitmap: its own bitmap and inode
+// blocks are in use, and so are the data blocks up to
+// freeblock.
 void
-balloc(int used)
+balloc(void)
 {
   uchar buf[BSIZE];
+  uint g, b;
+
+  printf("balloc: blocks before %d have been allocated\n", freeblock);
+  for(g = 0; g < ngroups; g++){
+    bzero(buf, BSIZE);
+    for(b = GSTART(g, sb); b < GSTART(g+1, sb) && b < FSSIZE; b++)
+      if(b < GDATA(g, sb) || b < freeblock)
+        buf[BBIT(b, sb)/8] |= 0x1 << (BBIT(b, sb)%8);
+    printf("balloc: write bitmap block at sector %d\n", GSTART(g, sb));
+    wsect(GSTART(g, sb), buf);
+  }
+}
+
+// Hash name to its bucket in a hashed directory (see fs.h).
+uint
+dirhash(char *name)
+{
+  uint h;
   int i;
 
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDIRHASH;
+}
+
+// Add a zeroed block to rootdir and return its number.
+uint
+dirgrow(void)
+{
+  assert(rootblocks < NROOTBLOCKS);
+  return rootblocks++;
+}
+
+// Add (name, inum) to the root directory, as the kernel's
+// dirinsert() would: buckets share a block until it is full,
+// then the block is split, or the bucket's chain extended.
+void
+dirinsert(char *name, uint inum)
+{
+  uint h, k, b, nb, lo, hi, mid, i, j, split;
+  struct dirent *d, *nd;
+
+  h = dirhash(name);
+  split = 0;
+  for(;;){
+    if(rootdir[DIRHEAD(h)] == 0){
+      nb = dirgrow();
+      for(i = 0; i < NDIRHASH; i++)
+        rootdir[DIRHEAD(i)] = xshort(nb);
+      continue;
+    }
+
+    b = xshort(rootdir[DIRHEAD(h)]);
+    for(;;){
+      d = (struct dirent*)(rootdir + b*BSIZE/2);
+      for(i = 1; i < BSIZE/sizeof(*d); i++)
+        if(d[i].inum == 0)
+          goto found;
+      if((nb = xshort(rootdir[b*BSIZE/2 + DIRNEXT])) == 0)
+        break;
+      b = nb;
+    }
+
+    for(lo = h; lo > 0 && xshort(rootdir[DIRHEAD(lo-1)]) == b; lo--)
+      ;
+    for(hi = h+1; hi < NDIRHASH && xshort(rootdir[DIRHEAD(hi)]) == b; hi++)
+      ;
+    if(split || hi - lo < 2 || b != xshort(rootdir[DIRHEAD(h)]))
+      break;
+
+    mid = (lo + hi) / 2;
+    nb = dirgrow();
+    nd = (struct dirent*)(rootdir + nb*BSIZE/2);
+    for(i = mid; i < hi; i++)
+      rootdir[DIRHEAD(i)] = xshort(nb);
+    for(i = 1, j = 1; i < BSIZE/sizeof(*d); i++){
+      k = dirhash(d[i].name);
+      if(k >= mid && k < hi){
+        nd[j++] = d[i];
+        bzero(&d[i], sizeof(d[i]));
+      }
+    }
+    split = 1;
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+
+  nb = dirgrow();
+  rootdir[b*BSIZE/2 + DIRNEXT] = xshort(nb);
+  b = nb;
+  d = (struct dirent*)(rootdir + b*BSIZE/2);
+  i = 1;
+
+found:
+  d[i].inum = xshort(inum);
+  strncpy(d[i].name, name, DIRSIZ);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -256,11 +374,11 @@ void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, dbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, y;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -270,19 +388,36 @@ iappend(uint inum, void *xp, int n)
     assert(fbn < MAXFILE);
     if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+        din.addrs[fbn] = xint(newblock());
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+        din.addrs[NDIRECT] = xint(newblock());
       }
       rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
+        indirect[fbn - NDIRECT] = xint(newblock());
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
+    } else {
+      dbn = fbn - NDIRECT - NINDIRECT;
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(newblock());
+      }
+      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      if(indirect[dbn / NINDIRECT] == 0){
+        indirect[dbn / NINDIRECT] = xint(newblock());
+        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      }
+      y = xint(indirect[dbn / NINDIRECT]);
+      rsect(y, (char*)indirect);
+      if(indirect[dbn % NINDIRECT] == 0){
+        indirect[dbn % NINDIRECT] = xint(newblock());
+        wsect(y, (char*)indirect);
+      }
+      x = xint(indirect[dbn % NINDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
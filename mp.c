@@ -9,6 +9,8 @@
 #include "mp.h"
 #include "x86.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 
 struct cpu cpus[NCPU];
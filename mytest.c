@@ -2,10 +2,12 @@
 #include "user.h"
 #include "stat.h"
 #include "param.h"
+#include "memstat.h"
 
 int main()
 {	
 	char *memory_area = 0;
+	struct memstat ms;
 	// number of free space
 	printf(1, "=========================Initial Free Memory==============================\n");
 	printf(1, "free memory number: %d\n", freemem());
@@ -88,6 +90,11 @@ int main()
 	printf(1, "mmap result (first four letters): %c%c%c%c\n\n", memory_area[0], memory_area[1], memory_area[2], memory_area[3]);
 	printf(1, "munmap result: %d\n", munmap((uint) memory_area));
 
+	printf(1, "\n============================Memory Statistics=============================\n\n");
+	memstat(&ms);
+	printf(1, "free: %d, page tables: %d, kernel stacks: %d, pipes: %d\n", ms.pages[MS_FREE], ms.pages[MS_PGTBL], ms.pages[MS_KSTACK], ms.pages[MS_PIPE]);
+	printf(1, "mmap file: %d, anonymous: %d, buffer cache: %d, other kernel: %d\n", ms.pages[MS_MMAPFILE], ms.pages[MS_ANON], ms.pages[MS_BCACHE], ms.pages[MS_KERNEL]);
+
 	printf(1, "\n=======================Write without PROT_WRITE============================\n\n");
 	printf(1, "free memory number: %d\n", freemem());				// number of free space
 	memory_area = (char *) mmap(0, 8192, PROT_READ, MAP_POPULATE, fd, 0);
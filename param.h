@@ -1,19 +1,30 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define BALANCETICKS 10  // ticks between runqueue load balancing
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // initial size of the i-node cache
+#define NINODEMAX  1024  // most i-nodes the i-node cache grows to
+#define NDENTRY     512  // size of the directory entry cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // max # of blocks most FS ops write
+#define CREATEBLOCKS 16  // max # of blocks a create or link writes:
+                         // 2 inodes, child's block 0, 5 of the
+                         // directory (block 0, split, new split,
+                         // chained, new chained), 3 indirect and
+                         // 5 bitmap (one per block allocated)
+#define LOGSIZE      126  // max data blocks in on-disk log; mkfs picks the size
+#define NBUF         (MAXOPBLOCKS*3)  // initial size of disk block cache
+#define NBUFMAX      4096  // most buffers the block cache grows to, at boot
+#define READAHEAD    16  // blocks read ahead of a sequential reader
+#define FSSIZE       2000  // size of file system in blocks
 #define PROT_READ    0x1
 #define PROT_WRITE   0x2
 #define MAP_ANONYMOUS 0x1
 #define MAP_POPULATE  0x2
 #define MMAPBASE      0x40000000
+#define FAULTAROUND   8  // pages a file mmap fault maps at once
 
@@ -0,0 +1,60 @@
+// PCI configuration space access, through the legacy
+// configuration ports.  A device is named by a tag that
+// encodes its bus, device and function numbers.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+#define PCI_CONFADDR  0xCF8
+#define PCI_CONFDATA  0xCFC
+
+uint
+pciread(uint tag, int off)
+{
+  outl(PCI_CONFADDR, tag | (off & 0xFC));
+  return inl(PCI_CONFDATA);
+}
+
+void
+pciwrite(uint tag, int off, uint v)
+{
+  outl(PCI_CONFADDR, tag | (off & 0xFC));
+  outl(PCI_CONFDATA, v);
+}
+
+// Find the first function with the given vendor and device
+// ids, or class and subclass; -1 matches anything.
+// Stores its tag in *tagp and returns 0, or returns -1.
+int
+pcifind(int vendor, int device, int class, int subclass, uint *tagp)
+{
+  uint bus, dev, func, tag, id, cl;
+
+  for(bus = 0; bus < 256; bus++){
+    for(dev = 0; dev < 32; dev++){
+      for(func = 0; func < 8; func++){
+        tag = 0x80000000 | bus<<16 | dev<<11 | func<<8;
+        id = pciread(tag, PCI_ID);
+        if((id & 0xFFFF) == 0xFFFF){
+          if(func == 0)
+            break;
+          continue;
+        }
+        cl = pciread(tag, PCI_CLASS);
+        if((vendor < 0 || (id & 0xFFFF) == vendor) &&
+           (device < 0 || (id >> 16) == device) &&
+           (class < 0 || (cl >> 24) == class) &&
+           (subclass < 0 || ((cl >> 16) & 0xFF) == subclass)){
+          *tagp = tag;
+          return 0;
+        }
+        // Only multi-function devices have functions past 0.
+        if(func == 0 && (pciread(tag, PCI_HDRTYPE) & 0x800000) == 0)
+          break;
+      }
+    }
+  }
+  return -1;
+}
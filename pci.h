@@ -0,0 +1,11 @@
+// PCI configuration space registers.
+#define PCI_ID        0x00   // vendor id (low), device id (high)
+#define PCI_CMD       0x04   // command (low), status (high)
+#define PCI_CLASS     0x08   // revision, prog if, subclass, class
+#define PCI_HDRTYPE   0x0C   // header type is bits 16-23
+#define PCI_BAR0      0x10   // base address registers, 4 bytes each
+#define PCI_INTR      0x3C   // interrupt line is bits 0-7
+
+#define PCI_CMD_IO      0x1  // respond to I/O space accesses
+#define PCI_CMD_MEM     0x2  // respond to memory space accesses
+#define PCI_CMD_MASTER  0x4  // may act as bus master (DMA)
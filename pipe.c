@@ -2,11 +2,13 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "memstat.h"
 
 #define PIPESIZE 512
 
@@ -30,6 +32,7 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((p = (struct pipe*)kalloc()) == 0)
     goto bad;
+  ksetuse((char*)p, MS_PIPE);
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
@@ -4,11 +4,14 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
+#include "traps.h"
 #include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "memstat.h"
 
 //hardcoding: convert nice to weight value
 int nice_to_weight[40] = {
@@ -22,13 +25,43 @@ int nice_to_weight[40] = {
 	36, 29, 23, 18, 15
 };
 
+// 2^32 / nice_to_weight[nice], so that scaling runtime by
+// 1024/weight is a multiply and a shift instead of a division
+uint nice_to_wmult[40] = {
+	48357, 60447, 75558, 94447, 118058,
+	147573, 184468, 230590, 288233, 360286,
+	450348, 562979, 703632, 879576, 1099582,
+	1374390, 1717987, 2147484, 2684355, 3355443,
+	4194304, 5244160, 6557202, 8196502, 10250519,
+	12782641, 16025997, 20069941, 24970740, 31350126,
+	39045157, 48806447, 61356676, 76695845, 95443718,
+	119304647, 148102321, 186737709, 238609294, 286331153
+};
+
+// vruntime keeps this many fraction bits, so that heavy
+// processes still accrue vruntime for short runs
+#define VRUNTIME_SHIFT 10
+
+// Shortest time slice handed out (one clock tick), so that
+// light processes do not drown the cpu in timer interrupts
+#define MINSLICE 1000
+
+// Sleeping processes are kept in wait queues hashed by
+// their channel, so that wakeup() only looks at processes
+// that might be sleeping on it.
+#define WAITQSHIFT 6
+#define NWAITQ (1 << WAITQSHIFT)
+
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct proc *waitq[NWAITQ];
 } ptable;
 
 static struct proc *initproc;
 
+// A mapping made by mmap(), kept in its process's
+// p->mmaps tree in order of address.
 struct mmap_area {
   struct file *f;
   uint addr;
@@ -36,51 +69,288 @@ struct mmap_area {
   int offset;
   int prot;
   int flags;
-  struct proc *p;
+  // 1: private mapping with MAP_POPULATE
+  // -1: pages are mapped one fault at a time by page_fault_handler
+  int status;
+  struct rb_node node;
+  struct mmap_area *nextfree;  // free list link while unused
 };
 
-struct mmap_area mmap_areas[64];
-
-// 0: empty
-// 1: private mapping with MAP_POPULATE
-// -1: not mapped in physical page(will be handled by page_fault_handler)
-int mmap_status_flag[64] = {0,};
+// mmap_area structs are carved out of whole pages as needed,
+// so the number of mappings is limited only by memory.
+struct {
+  struct spinlock lock;
+  struct mmap_area *freelist;
+} mmapcache;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static int mmapdup(struct proc*, struct proc*);
 
-// Calculate total weight of RUNNABLE process
-int
-totalweight(struct proc *firstp, struct proc *lastp) {
-	struct proc *p;
-	int total_weight = 0;
-	
-	for(p = firstp; p < lastp; p++) {
-    		if(p->state != UNUSED)
-			total_weight += p->weight;
-	}
-   	return total_weight;
+// vruntime accrued by running for delta at the given nice:
+// delta * 1024 / weight, with VRUNTIME_SHIFT fraction bits.
+// 1024 / weight is nice_to_wmult[nice] >> 22.
+static uint64
+calcvruntime(uint delta, int nice)
+{
+	return ((uint64) delta * nice_to_wmult[nice]) >> (22 - VRUNTIME_SHIFT);
+}
+
+// Charge the time p has run on this cpu since it was switched
+// in, or since the last charge, to its actual_runtime.
+// Must be called with interrupts disabled.
+static void
+updatecurr(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 now = rdtsc();
+
+  p->actual_runtime += tscruntime(now - c->runstart);
+  c->runstart = now;
 }
 
-// Update vruntime and handle the overflow situation
+// Charge the runtime since the process was scheduled to its vruntime
 void
 vruntimeupdate(struct proc *curproc) {
-	// If vruntime is greater than max int value, vruntime becomes 0 
-	if (curproc->vruntime +
-	(1024 * ((double) (curproc->actual_runtime - curproc->scheduled_time) / curproc->weight)) > 2147483647) {
-  		curproc->int_overflow++;
-  		curproc->vruntime += 1024 * (double) (curproc->actual_runtime - curproc->scheduled_time)/curproc->weight - 2147483647;
-	}
-	else curproc->vruntime += (1024 * ((double) (curproc->actual_runtime - curproc->scheduled_time) / curproc->weight));
+	curproc->vruntime += calcvruntime(curproc->actual_runtime - curproc->scheduled_time, curproc->nice);
+	curproc->scheduled_time = curproc->actual_runtime;
 }
 
 void
 pinit(void)
 {
+  struct cpu *c;
+
   initlock(&ptable.lock, "ptable");
+  initlock(&mmapcache.lock, "mmapcache");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rq.lock, "runqueue");
+}
+
+// Does a run before b?
+static int
+vruntime_before(struct proc *a, struct proc *b)
+{
+  return a->vruntime < b->vruntime;
+}
+
+// Insert RUNNABLE process p into rq, after any
+// processes with an equal key.
+// The runqueue lock must be held.
+static void
+enqueue(struct runqueue *rq, struct proc *p)
+{
+  struct rb_node **link = &rq->root.node, *parent = 0;
+  int leftmost = 1;
+
+  while(*link){
+    parent = *link;
+    if(vruntime_before(p, container_of(parent, struct proc, rq_node)))
+      link = &parent->left;
+    else {
+      link = &parent->right;
+      leftmost = 0;
+    }
+  }
+  rb_link(&p->rq_node, parent, link);
+  rb_insert(&p->rq_node, &rq->root);
+  if(leftmost)
+    rq->leftmost = &p->rq_node;
+  rq->nr_running++;
+  rq->total_weight += p->weight;
+}
+
+// Remove p from rq.
+// The runqueue lock must be held.
+static void
+dequeue(struct runqueue *rq, struct proc *p)
+{
+  if(rq->leftmost == &p->rq_node)
+    rq->leftmost = rb_next(&p->rq_node);
+  rb_erase(&p->rq_node, &rq->root);
+  rq->nr_running--;
+  rq->total_weight -= p->weight;
+}
+
+// Process in rq with the smallest vruntime, or 0.
+static struct proc*
+rqfirst(struct runqueue *rq)
+{
+  if(rq->leftmost == 0)
+    return 0;
+  return container_of(rq->leftmost, struct proc, rq_node);
+}
+
+// Process in rq with the largest vruntime, or 0.
+static struct proc*
+rqlast(struct runqueue *rq)
+{
+  struct rb_node *n;
+
+  if((n = rb_last(&rq->root)) == 0)
+    return 0;
+  return container_of(n, struct proc, rq_node);
+}
+
+// Lock and return this cpu's runqueue.
+static struct runqueue*
+lockmyrq(void)
+{
+  struct runqueue *rq;
+
+  pushcli();
+  rq = &mycpu()->rq;
+  acquire(&rq->lock);
+  popcli();
+  return rq;
+}
+
+// Wait queue for chan.
+static struct proc**
+waitqueue(void *chan)
+{
+  // Fibonacci hashing of the channel address
+  return &ptable.waitq[((uint)chan * 2654435761U) >> (32 - WAITQSHIFT)];
+}
+
+// Add p to the wait queue for p->chan.
+// The ptable lock must be held.
+static void
+waitqadd(struct proc *p)
+{
+  struct proc **head = waitqueue(p->chan);
+
+  p->wprev = 0;
+  p->wnext = *head;
+  if(*head)
+    (*head)->wprev = p;
+  *head = p;
+}
+
+// Take p off the wait queue for p->chan.
+// The ptable lock must be held.
+static void
+waitqdel(struct proc *p)
+{
+  if(p->wprev)
+    p->wprev->wnext = p->wnext;
+  else
+    *waitqueue(p->chan) = p->wnext;
+  if(p->wnext)
+    p->wnext->wprev = p->wprev;
+  p->wnext = p->wprev = 0;
+}
+
+// Wake cpu c if it is halted in idle().
+// Must be called with interrupts disabled.
+static void
+kick(struct cpu *c)
+{
+  if(c->idle && c != mycpu())
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+}
+
+// Wake some halted cpu other than c, so it can steal work.
+static void
+kickidle(struct cpu *c)
+{
+  struct cpu *b;
+
+  for(b = cpus; b < &cpus[ncpu]; b++){
+    if(b != c && b->idle){
+      lapicipi(b->apicid, T_IRQ0 + IRQ_RESCHED);
+      return;
+    }
+  }
+}
+
+// Mark p RUNNABLE and queue it on the runqueue of cpus[p->cpu].
+// p must not be running anywhere.
+// The ptable lock must be held.
+static void
+setrunnable(struct proc *p)
+{
+  struct runqueue *rq = &cpus[p->cpu].rq;
+
+  acquire(&rq->lock);
+  p->state = RUNNABLE;
+  enqueue(rq, p);
+  release(&rq->lock);
+  kick(&cpus[p->cpu]);
+}
+
+// Nothing to run on c: halt until an interrupt arrives.
+// Cpu 0 keeps its periodic tick because it keeps time;
+// the others stop their timer and rely on kick().
+static void
+idle(struct cpu *c)
+{
+  cli();
+  // xchg orders this store before the load of nr_running;
+  // enqueuers update nr_running before they look at idle.
+  xchg(&c->idle, 1);
+  if(c->rq.nr_running == 0){
+    if(c != cpus)
+      lapiconeshot(0);
+    stihlt();
+  }
+  c->idle = 0;
+}
+
+// The cpu with the fewest queued processes.
+static struct cpu*
+leastloaded(void)
+{
+  struct cpu *c, *best = cpus;
+
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c->rq.nr_running < best->rq.nr_running)
+      best = c;
+  return best;
+}
+
+// Pull processes from the busiest runqueue onto c's until the
+// two are roughly even. An idle cpu steals at least one.
+// Only queued processes move; they are never mid-switch,
+// because a process queues itself under its cpu's runqueue
+// lock and that lock is held until it has switched out.
+static void
+balance(struct cpu *c)
+{
+  struct cpu *b, *busiest = 0;
+  struct runqueue *src, *dst = &c->rq;
+  struct proc *p;
+  int n;
+
+  for(b = cpus; b < &cpus[ncpu]; b++)
+    if(b != c && (busiest == 0 || b->rq.nr_running > busiest->rq.nr_running))
+      busiest = b;
+  if(busiest == 0 || busiest->rq.nr_running == 0)
+    return;
+  src = &busiest->rq;
+
+  // Take the two runqueue locks in cpu order to avoid deadlock.
+  if(busiest < c){
+    acquire(&src->lock);
+    acquire(&dst->lock);
+  } else {
+    acquire(&dst->lock);
+    acquire(&src->lock);
+  }
+  n = (src->nr_running - dst->nr_running) / 2;
+  if(n == 0 && dst->nr_running == 0 && src->nr_running > 0)
+    n = 1;
+  // Move from the right of the queue: those would wait longest.
+  while(n-- > 0 && (p = rqlast(src)) != 0){
+    dequeue(src, p);
+    p->cpu = c - cpus;
+    enqueue(dst, p);
+  }
+  release(&src->lock);
+  release(&dst->lock);
 }
 
 // Must be called with interrupts disabled
@@ -152,14 +422,18 @@ found:
   p->vruntime = 0;
   p->scheduled_time = 0;
   p->time_slice = 0;
-  p->int_overflow = 0;
+  p->cpu = 0;
   release(&ptable.lock);
 
+  p->mmaps.node = 0;
+  initlock(&p->mmaplock, "mmap");
+
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
     p->state = UNUSED;
     return 0;
   }
+  ksetuse(p->kstack, MS_KSTACK);
   sp = p->kstack + KSTACKSIZE;
 
   // Leave room for trap frame.
@@ -212,7 +486,34 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  p->cpu = cpuid();
+  setrunnable(p);
+
+  release(&ptable.lock);
+}
+
+// Start a kernel thread running fn(), which must never return.
+// It has no user memory, so it never leaves the kernel.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread: no proc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kthread: out of memory");
+  p->sz = 0;
+
+  // forkret returns to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->cpu = leastloaded() - cpus;
+  setrunnable(p);
 
   release(&ptable.lock);
 }
@@ -260,6 +561,16 @@ fork(void)
     np->state = UNUSED;
     return -1;
   }
+  if(mmapdup(curproc, np) < 0){
+    munmapall(np);
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
+  // Our writable pages are now copy-on-write.
+  lcr3(V2P(curproc->pgdir));
   np->sz = curproc->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
@@ -267,7 +578,6 @@ fork(void)
   np->nice = curproc->nice;
   np->weight = nice_to_weight[np->nice];
   np->vruntime = curproc->vruntime;
-  np->int_overflow = curproc->int_overflow;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
@@ -279,72 +589,13 @@ fork(void)
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
-  // copy the memory map areas
-  for (i = 0; i < 64; i++) {
-    // If the memory mep area is owned by current process
-    // and is used
-    // we should copy that memory map area
-    if (curproc == mmap_areas[i].p && mmap_status_flag[i] != 0) {
-      // Find the empty mmap_area
-      int mmap_area_idx = 0;
-      for (mmap_area_idx = 0; mmap_area_idx < 64; mmap_area_idx++) {
-        if (mmap_status_flag[mmap_area_idx] == 0) break;
-      }
-      // If there is no area, return -1
-      if (mmap_area_idx == 64) {
-        cprintf("Fork error: there is no empty mmap_area\n");
-        return -1;
-      }
-
-      // Fill the empty area with the information of parent
-      mmap_areas[mmap_area_idx].addr = mmap_areas[i].addr;
-      mmap_areas[mmap_area_idx].f = mmap_areas[i].f;
-      mmap_areas[mmap_area_idx].length = mmap_areas[i].length;
-      mmap_areas[mmap_area_idx].offset = mmap_areas[i].offset;
-      mmap_areas[mmap_area_idx].prot = mmap_areas[i].prot;
-      mmap_areas[mmap_area_idx].flags = mmap_areas[i].flags;
-      mmap_areas[mmap_area_idx].p = np;
-      mmap_status_flag[mmap_area_idx] = mmap_status_flag[i];
-
-      int length = mmap_areas[i].length;
-      int flags = mmap_areas[i].flags;
-      int offset = mmap_areas[i].offset;
-      uint addr = mmap_areas[i].addr;
-      struct file *pfile = mmap_areas[i].f;
-      int prot = mmap_areas[i].prot;
-
-      // If status is 1 (already memory mapped)
-      // do the same thing to the child
-      if (mmap_status_flag[i] == 1) {
-        if (flags == 0 || flags == MAP_POPULATE) pfile->off = offset;
-        char *mem = 0;
-        int i = 0;
-        for (i = 0; i < length; i += PGSIZE) {
-          if ((mem = kalloc()) == 0) return 0;
-          memset(mem, 0, PGSIZE);
-
-          // copy the memory area
-          char *memory_addr = (char *) mmap_areas[mmap_area_idx].addr;
-          for (int j = 0; j < PGSIZE; j++) {
-            mem[j] = memory_addr[i+j];
-          }
-          
-          // Create PTEs for virtual addresses starting at va that refer to
-          // physical addresses starting at pa. va and size might not
-          // be page-aligned.
-          // mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm) 
-          mappages(np->pgdir, (void *) (addr + i), PGSIZE, V2P(mem), prot | PTE_U);
-        }
-        mmap_status_flag[mmap_area_idx] = 1;
-      }
-    }
-  }
-
   pid = np->pid;
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  // Start the child on the least busy cpu.
+  np->cpu = leastloaded() - cpus;
+  setrunnable(np);
 
   release(&ptable.lock);
 
@@ -364,6 +615,9 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Drop the mmap areas; freevm() in wait() frees their pages.
+  munmapall(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -372,14 +626,15 @@ exit(void)
     }
   }
 
-  begin_op();
+  begin_opn(ifreeblocks());
   iput(curproc->cwd);
   end_op();
   curproc->cwd = 0;
   
+  acquire(&ptable.lock);
   // Calculate vruntime
+  updatecurr(curproc);
   vruntimeupdate(curproc);
-  acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
   wakeup1(curproc->parent);
@@ -394,7 +649,11 @@ exit(void)
   }
 
   // Jump into the scheduler, never to return.
+  // wait() will not free our stack until the runqueue
+  // lock is dropped by the scheduler we switch to.
+  lockmyrq();
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -417,7 +676,10 @@ wait(void)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
-        // Found one.
+        // Found one. Wait for it to finish switching
+        // away from its kernel stack before freeing it.
+        acquire(&cpus[p->cpu].rq.lock);
+        release(&cpus[p->cpu].rq.lock);
         pid = p->pid;
         kfree(p->kstack);
         p->kstack = 0;
@@ -447,7 +709,7 @@ wait(void)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run from this cpu's runqueue
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -455,8 +717,8 @@ void
 scheduler(void)
 {
   struct proc *p;
-  struct proc *shortestjob = 0;
   struct cpu *c = mycpu();
+  struct runqueue *rq = &c->rq;
   uint total_weight = 0;
   c->proc = 0;
 
@@ -464,47 +726,61 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-
-    // Gain a total weight value
-    total_weight = totalweight(ptable.proc, &ptable.proc[NPROC]);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if (p->state != RUNNABLE) 
-      	continue;
-
-      // Find the shortest runtime process 
-      shortestjob = p;
-      for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      	if (p->state == RUNNABLE) {
-	  if (p->int_overflow < shortestjob->int_overflow)
-      	    shortestjob = p;
-	  else if (p->int_overflow == shortestjob->int_overflow && p->vruntime < shortestjob->vruntime)
-            shortestjob = p;
-      	}
-      }
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      shortestjob->time_slice = 1000 * (int) ((double) shortestjob->weight / total_weight + 0.5) * 10;
-      shortestjob->scheduled_time = shortestjob->actual_runtime;
-      c->proc = shortestjob;
-      switchuvm(shortestjob);
-      shortestjob->state = RUNNING;
-
-      swtch(&(c->scheduler), shortestjob->context);
-      switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+    // Periodically even out the load between cpus,
+    // and look for work elsewhere when there is none here.
+    if(rq->nr_running == 0 || ticks - c->last_balance >= BALANCETICKS){
+      c->last_balance = ticks;
+      balance(c);
     }
-    release(&ptable.lock);
+
+    acquire(&rq->lock);
+
+    // The leftmost process on the runqueue has the
+    // smallest vruntime; take it off the queue to run it.
+    if((p = rqfirst(rq)) == 0){
+      release(&rq->lock);
+      idle(c);
+      continue;
+    }
+
+    // Time slice is proportional to the weight of the
+    // chosen process over the weight of the runqueue.
+    total_weight = rq->total_weight;
+    dequeue(rq, p);
+
+    // Others are still waiting here; wake an idle cpu to take some.
+    if(rq->nr_running > 0)
+      kickidle(c);
+
+    // Switch to chosen process.  It is the process's job
+    // to release this cpu's runqueue lock and then reacquire
+    // it before jumping back to us.
+    p->time_slice = (10000 * p->weight + total_weight / 2) / total_weight;
+    if(p->time_slice < MINSLICE)
+      p->time_slice = MINSLICE;
+    p->scheduled_time = p->actual_runtime;
+    p->cpu = c - cpus;
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    // Cpu 0 checks the slice on every tick; the others
+    // take a single interrupt when it runs out.
+    if(c != cpus)
+      lapiconeshot(p->time_slice);
+    c->runstart = rdtsc();
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&rq->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must hold only this cpu's runqueue
+// lock and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
@@ -516,8 +792,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&mycpu()->rq.lock))
+    panic("sched rq lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -533,12 +809,17 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
+  struct runqueue *rq;
+
+  rq = lockmyrq();  //DOC: yieldlock
    
+  updatecurr(myproc());
   vruntimeupdate(myproc()); // Update vruntime 
   myproc()->state = RUNNABLE;
+  enqueue(rq, myproc());
   sched();
-  release(&ptable.lock);
+  // We may have been moved to another cpu while queued.
+  release(&mycpu()->rq.lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -547,16 +828,16 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding this cpu's runqueue lock from scheduler.
+  release(&mycpu()->rq.lock);
 
   if (first) {
     // Some initialization functions must be run in the context
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
-    iinit(ROOTDEV);
     initlog(ROOTDEV);
+    iinit(ROOTDEV);  // after recovery, which may change the bitmap
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -586,12 +867,21 @@ sleep(void *chan, struct spinlock *lk)
     release(lk);
   }
   // Go to sleep.
+  updatecurr(p);
   vruntimeupdate(p); 
   p->chan = chan;
+  waitqadd(p);
+  // wakeup() queues us on this cpu's runqueue, whose lock
+  // we hold until sched() has switched away, so it is safe
+  // to let go of ptable.lock now.
+  lockmyrq();
   p->state = SLEEPING;
+  release(&ptable.lock);
   sched();
+  release(&mycpu()->rq.lock);
 
   // Tidy up.
+  acquire(&ptable.lock);
   p->chan = 0;
 
   // Reacquire original lock.
@@ -607,40 +897,54 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
-  struct proc *shortest = 0;
-  // Looking for RUNNABLE process
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if (p->state == RUNNABLE) 
-        continue;
-      shortest = p;
-  }
-  // Looking for shortest runtime RUNNABLE process
-  // considering overflow
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if(p->state == RUNNABLE) {
-	if(p->int_overflow < shortest->int_overflow)
-    	  shortest = p;
-	else if (p->int_overflow == shortest->int_overflow && p->vruntime < shortest->vruntime) 
-	  shortest = p;
-    }
-  }
-  // Wake up
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+  struct proc *p, *next;
+  struct proc *shortest;
+  struct runqueue *rq;
+  uint64 vslice;
+
+  // Wake up onto the cpu each process last ran on.
+  // Other channels can share the wait queue.
+  for(p = *waitqueue(chan); p != 0; p = next) {
+    next = p->wnext;
     if(p->state == SLEEPING && p->chan == chan) {
+      waitqdel(p);
+      rq = &cpus[p->cpu].rq;
+      acquire(&rq->lock);
+      // Place it one tick's worth of its own vruntime ahead of
+      // the shortest runtime RUNNABLE process
+      shortest = rqfirst(rq);
+      vslice = calcvruntime(1000, p->nice);
+      if (shortest && shortest->vruntime > vslice)
+        p->vruntime = shortest->vruntime - vslice;
+      else
+        p->vruntime = 0;
       p->state = RUNNABLE;
-      if (shortest->int_overflow != 0 || shortest->vruntime != 0) {
-        p->vruntime = (shortest->vruntime - (int) (1024 / (double) p->weight + 0.5)) * 1000;
-        p->int_overflow = shortest->int_overflow;
-      }
-      else {
-	p->vruntime = shortest->vruntime;
-	p->int_overflow = 0;
-      }
+      enqueue(rq, p);
+      release(&rq->lock);
+      kick(&cpus[p->cpu]);
     }
   }
 }
 
+// Called on a timer interrupt while myproc() is running.
+// Charges the time it has run and returns 1 if its time
+// slice is used up.  Otherwise, on cpus that use one-shot
+// slice timers, re-arms the timer for what is left.
+int
+slicetick(void)
+{
+  struct proc *p = myproc();
+  uint used;
+
+  updatecurr(p);
+  used = p->actual_runtime - p->scheduled_time;
+  if(used >= p->time_slice)
+    return 1;
+  if(cpuid() != 0)
+    lapiconeshot(p->time_slice - used);
+  return 0;
+}
+
 // Wake up all processes sleeping on chan.
 void
 wakeup(void *chan)
@@ -664,8 +968,9 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING) {
-        p->state = RUNNABLE;
- 	vruntimeupdate(p);       
+        waitqdel(p);
+        vruntimeupdate(p);
+        setrunnable(p);
       }
       release(&ptable.lock);
       return 0;
@@ -733,6 +1038,7 @@ int
 setnice(int pid, int value)
 {
   struct proc *p;
+  struct runqueue *rq;
   
   if(value > 39 || value < 0)
 	  return -1;
@@ -740,8 +1046,23 @@ setnice(int pid, int value)
   acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
+      // Keep the runqueue's total weight in step. A queued
+      // process can be moved to another cpu until we hold
+      // the lock of the runqueue it is on.
+      for(;;){
+        rq = &cpus[p->cpu].rq;
+        acquire(&rq->lock);
+        if(rq == &cpus[p->cpu].rq)
+          break;
+        release(&rq->lock);
+      }
+      if(p->state == RUNNABLE)
+        rq->total_weight -= p->weight;
       p->nice = value;
       p->weight = nice_to_weight[p->nice];
+      if(p->state == RUNNABLE)
+        rq->total_weight += p->weight;
+      release(&rq->lock);
       break;
     }
   }
@@ -754,7 +1075,7 @@ ps(int pid)
 {
   struct proc *p;
   acquire(&ptable.lock);
-  cprintf("name\tpid\tstate\t\tpriority\truntime/weight   runtime   \tvruntime\ttick %d\n", 1000*ticks);
+  cprintf("name\tpid\tstate\t\tpriority\truntime/weight   runtime   \tvruntime\tcpu\ttick %d\n", 1000*ticks);
   if(pid == 0){
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
       if(p->state == 0)
@@ -782,9 +1103,9 @@ ps(int pid)
       }
 
       if (p->actual_runtime == 0)	
-	cprintf("%d\t        %d\t\t %d   \t\t%d\n", p->nice, p->actual_runtime/p->weight, p->actual_runtime, p->vruntime);
+	cprintf("%d\t        %d\t\t %d   \t\t%d\t\t%d\n", p->nice, (uint)p->actual_runtime/p->weight, (uint)p->actual_runtime, (uint)(p->vruntime >> VRUNTIME_SHIFT), p->cpu);
       else 
-	cprintf("%d\t        %d\t\t %d   \t%d\n", p->nice, p->actual_runtime/p->weight, p->actual_runtime, p->vruntime);
+	cprintf("%d\t        %d\t\t %d   \t%d\t\t%d\n", p->nice, (uint)p->actual_runtime/p->weight, (uint)p->actual_runtime, (uint)(p->vruntime >> VRUNTIME_SHIFT), p->cpu);
     }
     release(&ptable.lock);
     return;
@@ -818,9 +1139,9 @@ ps(int pid)
       }
 	
       if (p->actual_runtime == 0)	
-	cprintf("%d\t        %d\t\t %d   \t\t%d\n", p->nice, p->actual_runtime/p->weight, p->actual_runtime, p->vruntime);
+	cprintf("%d\t        %d\t\t %d   \t\t%d\t\t%d\n", p->nice, (uint)p->actual_runtime/p->weight, (uint)p->actual_runtime, (uint)(p->vruntime >> VRUNTIME_SHIFT), p->cpu);
       else 
-	cprintf("%d\t        %d\t\t %d   \t%d\n", p->nice, p->actual_runtime/p->weight, p->actual_runtime, p->vruntime);
+	cprintf("%d\t        %d\t\t %d   \t%d\t\t%d\n", p->nice, (uint)p->actual_runtime/p->weight, (uint)p->actual_runtime, (uint)(p->vruntime >> VRUNTIME_SHIFT), p->cpu);
       release(&ptable.lock);
       return;
     }
@@ -830,6 +1151,141 @@ ps(int pid)
   return;
 }
 
+static struct mmap_area*
+mmapalloc(void)
+{
+  struct mmap_area *a;
+  char *mem;
+  int i;
+
+  acquire(&mmapcache.lock);
+  if(mmapcache.freelist == 0){
+    release(&mmapcache.lock);
+    if((mem = kalloc()) == 0)
+      return 0;
+    acquire(&mmapcache.lock);
+    a = (struct mmap_area*)mem;
+    for(i = 0; i < PGSIZE / sizeof(*a); i++){
+      a[i].nextfree = mmapcache.freelist;
+      mmapcache.freelist = &a[i];
+    }
+  }
+  a = mmapcache.freelist;
+  mmapcache.freelist = a->nextfree;
+  release(&mmapcache.lock);
+  memset(a, 0, sizeof(*a));
+  return a;
+}
+
+static void
+mmapfree(struct mmap_area *a)
+{
+  acquire(&mmapcache.lock);
+  a->nextfree = mmapcache.freelist;
+  mmapcache.freelist = a;
+  release(&mmapcache.lock);
+}
+
+// Add a to p's mmap areas.  Caller holds p->mmaplock.
+static void
+mmapinsert(struct proc *p, struct mmap_area *a)
+{
+  struct rb_node **link = &p->mmaps.node, *parent = 0;
+
+  while(*link){
+    parent = *link;
+    if(a->addr < container_of(parent, struct mmap_area, node)->addr)
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+  rb_link(&a->node, parent, link);
+  rb_insert(&a->node, &p->mmaps);
+}
+
+// Find an mmap area of p overlapping [addr, end), or 0.
+// Caller holds p->mmaplock.
+static struct mmap_area*
+mmapfind(struct proc *p, uint addr, uint end)
+{
+  struct rb_node *n = p->mmaps.node;
+  struct mmap_area *a;
+
+  while(n){
+    a = container_of(n, struct mmap_area, node);
+    if(end <= a->addr)
+      n = n->left;
+    else if(addr >= a->addr + a->length)
+      n = n->right;
+    else
+      return a;
+  }
+  return 0;
+}
+
+// Give child a copy of each of parent's mmap areas,
+// sharing the pages of populated ones.
+// Returns 0 on success, -1 if memory ran out.
+static int
+mmapdup(struct proc *parent, struct proc *child)
+{
+  struct rb_node *n;
+  struct mmap_area *a, *na;
+  pte_t *pte;
+  int i;
+
+  acquire(&parent->mmaplock);
+  for(n = rb_first(&parent->mmaps); n != 0; n = rb_next(n)){
+    a = container_of(n, struct mmap_area, node);
+    if((na = mmapalloc()) == 0)
+      goto bad;
+    na->f = a->f ? filedup(a->f) : 0;
+    na->addr = a->addr;
+    na->length = a->length;
+    na->offset = a->offset;
+    na->prot = a->prot;
+    na->flags = a->flags;
+    na->status = a->status;
+    mmapinsert(child, na);
+
+    // share the pages mapped so far with the child, copy-on-write
+    for (i = 0; i < a->length; i += PGSIZE) {
+      pte = walkpgdir(parent->pgdir, (char *) (a->addr + i), 0);
+      if (pte == 0 || (*pte & PTE_P) == 0) continue;
+      if (sharepage(child->pgdir, pte, a->addr + i) < 0) goto bad;
+    }
+  }
+  release(&parent->mmaplock);
+  return 0;
+
+bad:
+  release(&parent->mmaplock);
+  return -1;
+}
+
+// Forget all of p's mmap areas without touching its page
+// table, which the caller is about to free.
+void
+munmapall(struct proc *p)
+{
+  struct rb_node *n;
+  struct mmap_area *a;
+
+  for(;;){
+    acquire(&p->mmaplock);
+    if((n = p->mmaps.node) == 0){
+      release(&p->mmaplock);
+      return;
+    }
+    a = container_of(n, struct mmap_area, node);
+    rb_erase(n, &p->mmaps);
+    release(&p->mmaplock);
+    if(a->f)
+      fileclose(a->f);
+    mmapfree(a);
+  }
+}
+
 // Succeed: return the start address of mapping area
 // Failed: return 0
 uint
@@ -871,7 +1327,7 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
   }
   // NOT ANONYMOUS
   else { 
-    if (fd < 0) return 0;
+    if (fd < 0 || fd >= NOFILE) return 0;
     if (offset < 0) return 0;
     pfile = curproc->ofile[fd];
   }
@@ -881,57 +1337,36 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
   // PROT_WRITE but not writable      
   // => INVALID
   if (!(flags & MAP_ANONYMOUS)) {
-    if (pfile->type != FD_INODE) return 0;
+    if (pfile == 0 || pfile->type != FD_INODE) return 0;
     if ((prot & PROT_READ) == PROT_READ && !pfile->readable) return 0;
     if ((prot & PROT_WRITE) == PROT_WRITE && !pfile->writable) return 0;
   }
 
   // memory mapping
-  int mmap_area_idx = 0;
-  uint tmp_addr = 0;
-  uint tmp_end_addr = 0;
-  uint addr_end = addr + length;
-
-  // overlapping handling
-  for (mmap_area_idx = 0; mmap_area_idx < 64; mmap_area_idx++) {
-    // Find already using areas
-    if (mmap_status_flag[mmap_area_idx] != 0) {
-      // The start address of already using area
-      tmp_addr = mmap_areas[mmap_area_idx].addr;
-      // The end address of already using area
-      tmp_end_addr = mmap_areas[mmap_area_idx].addr + mmap_areas[mmap_area_idx].length;
-
-      // The mapping area is overlapped => INVALID
-      if (addr_end <= tmp_addr) continue;
-      else if (tmp_end_addr <= addr) continue;
-      else return 0;
-    }
-  }
-
-  // Find the empty mmap_areas idx
-  mmap_area_idx = 0;
-  for (mmap_area_idx = 0; mmap_area_idx < 64; mmap_area_idx++) {
-    if (mmap_status_flag[mmap_area_idx] == 0) {
-      break;
-    }
-  }
-  // If Not Found
-  if (mmap_area_idx == 64) return 0; 
+  struct mmap_area *area;
+  if ((area = mmapalloc()) == 0) return 0;
 
   // If ANONYMOUS, pfile is 0
-  if (pfile == 0) mmap_areas[mmap_area_idx].f = 0;
   // If Not ANONYMOUS => File mapping
-  else mmap_areas[mmap_area_idx].f = filedup(pfile);
-
-  // Store the mmap_area information to array
-  mmap_areas[mmap_area_idx].addr = addr;
-  mmap_areas[mmap_area_idx].length = length;
-  mmap_areas[mmap_area_idx].offset = offset;
-  mmap_areas[mmap_area_idx].prot = prot;
-  mmap_areas[mmap_area_idx].flags = flags;
-  mmap_areas[mmap_area_idx].p = curproc;
+  area->f = pfile;
+  area->addr = addr;
+  area->length = length;
+  area->offset = offset;
+  area->prot = prot;
+  area->flags = flags;
   // -1 means mapping without MAP_POPULATE(default)
-  mmap_status_flag[mmap_area_idx] = -1;
+  area->status = -1;
+
+  // The mapping area is overlapped => INVALID
+  acquire(&curproc->mmaplock);
+  if (mmapfind(curproc, addr, addr + length) != 0) {
+    release(&curproc->mmaplock);
+    mmapfree(area);
+    return 0;
+  }
+  mmapinsert(curproc, area);
+  release(&curproc->mmaplock);
+  if (pfile) filedup(pfile);
 
   if (flags == 0) {
     // file mapping, just record its mapping area
@@ -954,6 +1389,7 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
     for (i = 0; i < length; i += PGSIZE) {
       // allocate
       if ((mem = kalloc()) == 0) return 0;  
+      ksetuse(mem, MS_MMAPFILE);
       // fill 0 to the page
       memset(mem, 0, PGSIZE);
       // read the file
@@ -967,7 +1403,7 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
       if (mappages(curproc->pgdir, (void *) (addr + i), PGSIZE, V2P(mem), prot | PTE_U) == -1) return 0;
     }
     // flag 1: private mapping with MAP_POPULATE
-    mmap_status_flag[mmap_area_idx] = 1;
+    area->status = 1;
   }
   else if (flags == (MAP_ANONYMOUS | MAP_POPULATE)) { // private anonymous mapping with MAP_POPULATE
     char *mem = 0;
@@ -975,6 +1411,7 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
     for (i = 0; i < length; i += PGSIZE) {
       // allocate
       if ((mem = kalloc()) == 0) return 0;
+      ksetuse(mem, MS_ANON);
       // fill 0 to the page
       memset(mem, 0, PGSIZE);
 
@@ -987,66 +1424,85 @@ mmap(uint addr, int length, int prot, int flags, int fd, int offset)
       if (mappages(curproc->pgdir, (void *) (addr + i), PGSIZE, V2P(mem), prot | PTE_U) == -1) return 0;
     }
     // flag 1: private mapping with MAP_POPULATE
-    mmap_status_flag[mmap_area_idx] = 1;
+    area->status = 1;
   }
 
   return addr;
 }
 
 int page_fault_handler(uint error) {
-  uint va;
+  uint va, start, end, a;
   struct proc *curproc = myproc();
+  struct mmap_area *area;
+  pte_t *pte;
+  char *mem;
   // get the page fault virtual address
   if ((va = rcr2()) < 0) {
     cprintf("Page fault: cannot get the page fault virtual address\n");
     return -1;
   }
+
+  // Write to a page shared copy-on-write since fork
+  if ((error & 2) == 2 && cowfault(curproc->pgdir, va) == 0) return 1;
   
   // find mmap_area of the faulted address
-  int mmap_area_idx = 0;
-  for (mmap_area_idx = 0; mmap_area_idx < 64; mmap_area_idx++) {
-    // If virtual address is in the range of certain mmap_area, and the process is the same
-    // break the loop
-    if (mmap_areas[mmap_area_idx].addr <= va && va < mmap_areas[mmap_area_idx].addr + mmap_areas[mmap_area_idx].length) {
-      if (mmap_areas[mmap_area_idx].p == curproc) {
-        va = mmap_areas[mmap_area_idx].addr;
-        break;
-      }
-    }
-  }
+  acquire(&curproc->mmaplock);
+  area = mmapfind(curproc, va, va + 1);
+  release(&curproc->mmaplock);
   // If faulted address has no corresponding mmap_area
-  if (mmap_area_idx == 64) {
+  if (area == 0) {
     cprintf("Page fault: faulted address has no corresponding mmap_area\n");
     return -1;
   }
+  va = PGROUNDDOWN(va);
 
   // Cannot read, but tried to read
-  if ((mmap_areas[mmap_area_idx].prot & PROT_READ) != 1 && (error & 2) == 0) {
+  if ((area->prot & PROT_READ) != 1 && (error & 2) == 0) {
     cprintf("Page fault: cannot read, but tried to read\n");
     return -1;
   }
   // Cannot write, but tried to write
-  if ((mmap_areas[mmap_area_idx].prot & PROT_WRITE) != 2 && (error & 2) == 2) {
+  if ((area->prot & PROT_WRITE) != 2 && (error & 2) == 2) {
     cprintf("Page fault: cannot write, but tried to write\n");
     return -1;
   }
 
-  if (mmap_status_flag[mmap_area_idx] != -1) return -1;
-  // For only one page according to faulted address, allocate new physical page, and fill new page with 0
-  char *mem = 0;  
-  if ((mem = kalloc()) == 0) return -1;
-  memset(mem, 0, PGSIZE);
-  if ((mmap_areas[mmap_area_idx].flags & MAP_ANONYMOUS) == 0) {
-    mmap_areas[mmap_area_idx].f->off = mmap_areas[mmap_area_idx].offset;
-    if (fileread(mmap_areas[mmap_area_idx].f, mem, PGSIZE) == -1) return -1;
+  // The page is already there, so this was not a missing page
+  pte = walkpgdir(curproc->pgdir, (char *) va, 0);
+  if (pte != 0 && (*pte & PTE_P) != 0) return -1;
+
+  // A file mapping brings in the whole FAULTAROUND-page window
+  // around the faulted page, so a sequential scan faults once per
+  // window instead of once per page. Anonymous pages are only
+  // allocated when touched.
+  start = va;
+  end = va + PGSIZE;
+  if (area->f) {
+    start = area->addr + (va - area->addr) / (FAULTAROUND*PGSIZE) * (FAULTAROUND*PGSIZE);
+    end = start + FAULTAROUND*PGSIZE;
+    if (end > area->addr + area->length) end = area->addr + area->length;
+    ilock(area->f->ip);
+    // Queue the whole window's blocks before reading the first
+    readahead(area->f->ip, area->offset + (start - area->addr), end - start);
   }
-        
-  // Create PTEs for virtual addresses starting at va that refer to
-  // physical addresses starting at pa. va and size might not
-  // be page-aligned.
-  // mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm) 
-  if (mappages(curproc->pgdir, (void *) va, PGSIZE, V2P(mem), mmap_areas[mmap_area_idx].prot | PTE_U) == -1) return -1;
-  mmap_status_flag[mmap_area_idx] = 1;
+  for (a = start; a < end; a += PGSIZE) {
+    pte = walkpgdir(curproc->pgdir, (char *) a, 0);
+    if (pte != 0 && (*pte & PTE_P) != 0) continue;
+    if ((mem = kalloc()) == 0) break;
+    ksetuse(mem, area->f ? MS_MMAPFILE : MS_ANON);
+    // fill 0 to the page, then read whatever part of it the file covers
+    memset(mem, 0, PGSIZE);
+    if (area->f) readi(area->f->ip, mem, area->offset + (a - area->addr), PGSIZE);
+    if (mappages(curproc->pgdir, (void *) a, PGSIZE, V2P(mem), area->prot | PTE_U) == -1) {
+      kfree(mem);
+      break;
+    }
+  }
+  if (area->f) iunlock(area->f->ip);
+
+  // Only the faulted page has to be there; the rest is a bonus
+  pte = walkpgdir(curproc->pgdir, (char *) va, 0);
+  if (pte == 0 || (*pte & PTE_P) == 0) return -1;
   return 1;
 }
 
@@ -1058,40 +1514,38 @@ munmap(uint addr) {
   if (addr%PGSIZE != 0) return -1;
 
   struct proc *curproc = myproc();
+  struct mmap_area *area;
 
-  // Find the corresponding mmap_area_arr idx
-  int mmap_area_idx = 0;
-  for (mmap_area_idx = 0; mmap_area_idx < 64; mmap_area_idx++) {
-    if (mmap_areas[mmap_area_idx].addr == addr 
-      && mmap_areas[mmap_area_idx].p == curproc 
-      && mmap_status_flag[mmap_area_idx] != 0) {
-      break;
-    }
-  }
+  // Find the corresponding mmap_area
+  acquire(&curproc->mmaplock);
+  area = mmapfind(curproc, addr, addr + 1);
   // If the corresponding mmap_area doesn't exist, it fails
-  if (mmap_area_idx == 64) return -1;
+  if (area == 0 || area->addr != addr) {
+    release(&curproc->mmaplock);
+    return -1;
+  }
+  rb_erase(&area->node, &curproc->mmaps);
+  release(&curproc->mmaplock);
 
-  if (mmap_status_flag[mmap_area_idx] == -1) {
-    mmap_status_flag[mmap_area_idx] = 0;
-    return 1;
-  } 
   pde_t *pte = 0;
-  int length = mmap_areas[mmap_area_idx].length;
+  int length = area->length;
 
   // Free the pages and page tables
   for(int i = 0; i < length; i += PGSIZE) {
-    // If there are no pte, it fails
+    // If there are no pte, skip the page
     if ((pte = walkpgdir(curproc->pgdir, (char *) (addr + i), 0)) == 0) {
-      return -1;
+      continue;
     }
     if((*pte & PTE_P) != 0) {          // If PTE is present
-      uint pa = PTE_ADDR(*pte) | ((addr + i) & 0xfff);  // Get the physical address
+      uint pa = PTE_ADDR(*pte);  // Get the physical address
       kfree(P2V(pa));       // Free the address
       *pte = 0;             // Make the pte empty
     }
   }
-  
-  // Reset the status to 0(not used)
-  mmap_status_flag[mmap_area_idx] = 0;
+  // The stale translations must not outlive the pages.
+  lcr3(V2P(curproc->pgdir));
+
+  if (area->f) fileclose(area->f);
+  mmapfree(area);
   return 1;
-}
\ No newline at end of file
+}
@@ -1,3 +1,14 @@
+// Queue of RUNNABLE processes ordered by vruntime.
+// The running process is not on the queue; it is put back
+// when it yields and taken off again when it is picked.
+struct runqueue {
+  struct spinlock lock;        // Held across the switch into a process
+  struct rb_root root;         // Processes keyed by vruntime
+  struct rb_node *leftmost;    // Cached smallest key, or 0 if empty
+  int nr_running;              // Number of queued processes
+  uint total_weight;           // Sum of weights of queued processes
+};
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,6 +19,10 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct runqueue rq;          // Processes waiting to run on this cpu
+  uint last_balance;           // ticks at the last load balance
+  uint64 runstart;             // TSC when proc's runtime was last charged
+  volatile uint idle;          // Halted in idle(); needs an IPI to notice work
 };
 
 extern struct cpu cpus[NCPU];
@@ -52,11 +67,17 @@ struct proc {
   char name[16];               // Process name (debugging)
 
   uint time_slice;             // time slice of this process
-  uint vruntime;               // virtual runtime
-  uint actual_runtime;         // actual runtime
-  int int_overflow;            // the number of overflow
-  uint scheduled_time;         // the actual_runtime when process was scheduled
+  uint64 vruntime;             // virtual runtime, fixed point (see proc.c)
+  uint64 actual_runtime;       // actual runtime
+  uint64 scheduled_time;       // the actual_runtime when process was scheduled
   uint weight;                 // weight of this process
+  struct rb_node rq_node;      // Link in the runqueue while RUNNABLE
+  int cpu;                     // Index of the cpu whose runqueue p is on
+  struct proc *wnext;          // Next sleeper in the same wait queue
+  struct proc *wprev;          // Previous sleeper in the same wait queue
+  struct rb_root mmaps;        // mmap areas, ordered by address
+  struct spinlock mmaplock;    // Protects mmaps
+  int logres;                  // Log blocks reserved by begin_opn()
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,279 @@
+// Red-black tree rebalancing, shared by the scheduler's
+// runqueues and anything else that needs an ordered index.
+// See rbtree.h for how callers insert nodes.
+
+#include "types.h"
+#include "defs.h"
+#include "rbtree.h"
+
+static void
+rotate_left(struct rb_node *x, struct rb_root *root)
+{
+  struct rb_node *y = x->right;
+
+  x->right = y->left;
+  if(y->left)
+    y->left->parent = x;
+  y->parent = x->parent;
+  if(x->parent == 0)
+    root->node = y;
+  else if(x == x->parent->left)
+    x->parent->left = y;
+  else
+    x->parent->right = y;
+  y->left = x;
+  x->parent = y;
+}
+
+static void
+rotate_right(struct rb_node *x, struct rb_root *root)
+{
+  struct rb_node *y = x->left;
+
+  x->left = y->right;
+  if(y->right)
+    y->right->parent = x;
+  y->parent = x->parent;
+  if(x->parent == 0)
+    root->node = y;
+  else if(x == x->parent->right)
+    x->parent->right = y;
+  else
+    x->parent->left = y;
+  y->right = x;
+  x->parent = y;
+}
+
+// Restore the red-black properties after node was
+// attached as a leaf with rb_link().
+void
+rb_insert(struct rb_node *node, struct rb_root *root)
+{
+  struct rb_node *parent, *gparent, *uncle;
+
+  while((parent = node->parent) != 0 && parent->color == RB_RED){
+    gparent = parent->parent;
+    if(parent == gparent->left){
+      uncle = gparent->right;
+      if(uncle && uncle->color == RB_RED){
+        parent->color = RB_BLACK;
+        uncle->color = RB_BLACK;
+        gparent->color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if(node == parent->right){
+        rotate_left(parent, root);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      gparent->color = RB_RED;
+      rotate_right(gparent, root);
+    } else {
+      uncle = gparent->left;
+      if(uncle && uncle->color == RB_RED){
+        parent->color = RB_BLACK;
+        uncle->color = RB_BLACK;
+        gparent->color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if(node == parent->left){
+        rotate_right(parent, root);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      gparent->color = RB_RED;
+      rotate_left(gparent, root);
+    }
+  }
+  root->node->color = RB_BLACK;
+}
+
+// Rebalance after removing a black node; node (possibly 0)
+// took its place below parent.
+static void
+erase_fixup(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+  struct rb_node *sib;
+
+  while(node != root->node && (node == 0 || node->color == RB_BLACK)){
+    if(node == parent->left){
+      sib = parent->right;
+      if(sib->color == RB_RED){
+        sib->color = RB_BLACK;
+        parent->color = RB_RED;
+        rotate_left(parent, root);
+        sib = parent->right;
+      }
+      if((sib->left == 0 || sib->left->color == RB_BLACK) &&
+         (sib->right == 0 || sib->right->color == RB_BLACK)){
+        sib->color = RB_RED;
+        node = parent;
+        parent = node->parent;
+      } else {
+        if(sib->right == 0 || sib->right->color == RB_BLACK){
+          sib->left->color = RB_BLACK;
+          sib->color = RB_RED;
+          rotate_right(sib, root);
+          sib = parent->right;
+        }
+        sib->color = parent->color;
+        parent->color = RB_BLACK;
+        if(sib->right)
+          sib->right->color = RB_BLACK;
+        rotate_left(parent, root);
+        node = root->node;
+        break;
+      }
+    } else {
+      sib = parent->left;
+      if(sib->color == RB_RED){
+        sib->color = RB_BLACK;
+        parent->color = RB_RED;
+        rotate_right(parent, root);
+        sib = parent->left;
+      }
+      if((sib->left == 0 || sib->left->color == RB_BLACK) &&
+         (sib->right == 0 || sib->right->color == RB_BLACK)){
+        sib->color = RB_RED;
+        node = parent;
+        parent = node->parent;
+      } else {
+        if(sib->left == 0 || sib->left->color == RB_BLACK){
+          sib->right->color = RB_BLACK;
+          sib->color = RB_RED;
+          rotate_left(sib, root);
+          sib = parent->left;
+        }
+        sib->color = parent->color;
+        parent->color = RB_BLACK;
+        if(sib->left)
+          sib->left->color = RB_BLACK;
+        rotate_right(parent, root);
+        node = root->node;
+        break;
+      }
+    }
+  }
+  if(node)
+    node->color = RB_BLACK;
+}
+
+// Replace subtree u with subtree v in u's parent.
+static void
+transplant(struct rb_node *u, struct rb_node *v, struct rb_root *root)
+{
+  if(u->parent == 0)
+    root->node = v;
+  else if(u == u->parent->left)
+    u->parent->left = v;
+  else
+    u->parent->right = v;
+  if(v)
+    v->parent = u->parent;
+}
+
+// Remove node from the tree.
+void
+rb_erase(struct rb_node *node, struct rb_root *root)
+{
+  struct rb_node *child, *parent, *next;
+  int color;
+
+  if(node->left == 0){
+    child = node->right;
+    parent = node->parent;
+    color = node->color;
+    transplant(node, child, root);
+  } else if(node->right == 0){
+    child = node->left;
+    parent = node->parent;
+    color = node->color;
+    transplant(node, child, root);
+  } else {
+    // Splice out the in-order successor and put it where node was.
+    next = node->right;
+    while(next->left)
+      next = next->left;
+    color = next->color;
+    child = next->right;
+    if(next->parent == node){
+      parent = next;
+    } else {
+      parent = next->parent;
+      transplant(next, child, root);
+      next->right = node->right;
+      next->right->parent = next;
+    }
+    transplant(node, next, root);
+    next->left = node->left;
+    next->left->parent = next;
+    next->color = node->color;
+  }
+  if(color == RB_BLACK)
+    erase_fixup(child, parent, root);
+  node->parent = node->left = node->right = 0;
+}
+
+// Leftmost (smallest) node, or 0 if the tree is empty.
+struct rb_node*
+rb_first(struct rb_root *root)
+{
+  struct rb_node *n;
+
+  if((n = root->node) == 0)
+    return 0;
+  while(n->left)
+    n = n->left;
+  return n;
+}
+
+// Rightmost (largest) node, or 0 if the tree is empty.
+struct rb_node*
+rb_last(struct rb_root *root)
+{
+  struct rb_node *n;
+
+  if((n = root->node) == 0)
+    return 0;
+  while(n->right)
+    n = n->right;
+  return n;
+}
+
+// In-order successor of node, or 0 if node is the last.
+struct rb_node*
+rb_next(struct rb_node *node)
+{
+  struct rb_node *parent;
+
+  if(node->right){
+    node = node->right;
+    while(node->left)
+      node = node->left;
+    return node;
+  }
+  while((parent = node->parent) != 0 && node == parent->right)
+    node = parent;
+  return parent;
+}
+
+// In-order predecessor of node, or 0 if node is the first.
+struct rb_node*
+rb_prev(struct rb_node *node)
+{
+  struct rb_node *parent;
+
+  if(node->left){
+    node = node->left;
+    while(node->right)
+      node = node->right;
+    return node;
+  }
+  while((parent = node->parent) != 0 && node == parent->left)
+    node = parent;
+  return parent;
+}
@@ -0,0 +1,33 @@
+// Intrusive red-black trees.
+// A struct rb_node is embedded in the structure being sorted;
+// container_of() recovers the enclosing structure. The tree code
+// only rebalances: callers walk the tree to find where a new node
+// belongs, link it there with rb_link(), then call rb_insert().
+struct rb_node {
+  struct rb_node *parent;
+  struct rb_node *left;
+  struct rb_node *right;
+  int color;                   // RB_RED or RB_BLACK
+};
+
+struct rb_root {
+  struct rb_node *node;        // Root of the tree, or 0 if empty
+};
+
+#define RB_RED    0
+#define RB_BLACK  1
+
+// Pointer to the structure of the given type that embeds member
+// at address ptr.
+#define container_of(ptr, type, member) \
+  ((type*)((char*)(ptr) - (uint)&((type*)0)->member))
+
+// Attach node as a red leaf at *link, below parent.
+static inline void
+rb_link(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+  node->parent = parent;
+  node->left = node->right = 0;
+  node->color = RB_RED;
+  *link = node;
+}
@@ -3,6 +3,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -69,6 +71,18 @@ argptr(int n, char **pp, int size)
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes that the kernel will
+// write, and give the process its own copy of any pages of
+// it that it shares copy-on-write.
+int
+argoutptr(int n, char **pp, int size)
+{
+  if(argptr(n, pp, size) < 0)
+    return -1;
+  return cowbreak(myproc()->pgdir, (uint)*pp, size);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -109,6 +123,11 @@ extern int sys_ps(void);
 extern int sys_mmap(void);
 extern int sys_munmap(void);
 extern int sys_freemem(void);
+extern int sys_memstat(void);
+extern int sys_bcachestat(void);
+extern int sys_setbcachemax(void);
+extern int sys_setiosched(void);
+extern int sys_iostat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -138,6 +157,11 @@ static int (*syscalls[])(void) = {
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]  sys_munmap,
 [SYS_freemem] sys_freemem,
+[SYS_memstat] sys_memstat,
+[SYS_bcachestat] sys_bcachestat,
+[SYS_setbcachemax] sys_setbcachemax,
+[SYS_setiosched] sys_setiosched,
+[SYS_iostat] sys_iostat,
 };
 
 void
@@ -25,4 +25,9 @@
 #define SYS_ps 24
 #define SYS_mmap 25
 #define SYS_munmap 26
-#define SYS_freemem 27
\ No newline at end of file
+#define SYS_freemem 27
+#define SYS_memstat 28
+#define SYS_bcachestat 29
+#define SYS_setbcachemax 30
+#define SYS_setiosched 31
+#define SYS_iostat 32
@@ -9,12 +9,15 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "fs.h"
-#include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "bcachestat.h"
+#include "iostat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -73,7 +76,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argoutptr(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -109,7 +112,7 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argoutptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -124,7 +127,7 @@ sys_link(void)
   if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -192,7 +195,8 @@ sys_unlink(void)
   if(argstr(0, &path) < 0)
     return -1;
 
-  begin_op();
+  // The dirent, dp and ip, and freeing ip.
+  begin_opn(2 + ifreeblocks());
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -218,6 +222,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheset(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -257,7 +262,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
+  if((ip = ialloc(dp->dev, type, dp)) == 0)
     panic("create: ialloc");
 
   ilock(ip);
@@ -293,7 +298,7 @@ sys_open(void)
   if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(omode & O_CREATE ? CREATEBLOCKS : ifreeblocks());
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -327,6 +332,7 @@ sys_open(void)
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
+  f->ranext = f->raend = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
   return fd;
@@ -338,7 +344,7 @@ sys_mkdir(void)
   char *path;
   struct inode *ip;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -355,7 +361,7 @@ sys_mknod(void)
   char *path;
   int major, minor;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   if((argstr(0, &path)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -375,7 +381,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *curproc = myproc();
   
-  begin_op();
+  begin_opn(ifreeblocks());
   if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -426,7 +432,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argoutptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
@@ -442,3 +448,45 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+int
+sys_bcachestat(void)
+{
+  struct bcachestat *st;
+
+  if(argoutptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  bcachestat(st);
+  return 0;
+}
+
+int
+sys_setbcachemax(void)
+{
+  int max;
+
+  if(argint(0, &max) < 0)
+    return -1;
+  return bsetmax(max);
+}
+
+int
+sys_setiosched(void)
+{
+  int sched;
+
+  if(argint(0, &sched) < 0)
+    return -1;
+  return setiosched(sched);
+}
+
+int
+sys_iostat(void)
+{
+  struct iostat *st;
+
+  if(argoutptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  iostat(st);
+  return 0;
+}
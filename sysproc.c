@@ -5,7 +5,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
+#include "memstat.h"
 
 int
 sys_fork(void)
@@ -160,4 +163,14 @@ int sys_munmap(void)
 int sys_freemem(void)
 {
   return freemem();
+}
+
+int sys_memstat(void)
+{
+  struct memstat *ms;
+
+  if(argoutptr(0, (void*)&ms, sizeof(*ms)) < 0)
+    return -1;
+  memstat(ms);
+  return 0;
 }
\ No newline at end of file
@@ -3,10 +3,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -60,6 +61,10 @@ trap(struct trapframe *tf)
     ideintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_RESCHED:
+    // Woken from idle(); the scheduler loop will look again.
+    lapiceoi();
+    break;
   case T_IRQ0 + IRQ_IDE+1:
     // Bochs generates spurious IDE1 interrupts.
     break;
@@ -81,9 +86,20 @@ trap(struct trapframe *tf)
     // call page fault handler
     // If success, break
     if (page_fault_handler(tf->err & 2) != -1) break;
-    else exit();
+    // A fault that cannot be fixed up kills a user process, but
+    // the kernel could be holding locks, so it must not exit()
+    // there; kernel writes to user memory break copy-on-write
+    // first (see argoutptr), so this is a kernel bug.
+    if ((tf->cs&3) != 0) exit();
+    // fall through
   //PAGEBREAK: 13
   default:
+    // A PCI disk's interrupt line is only known once it is found.
+    if(tf->trapno == T_IRQ0 + ideirq){
+      ideintr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -109,8 +125,7 @@ trap(struct trapframe *tf)
   // if the task runs more than time slice, enforce a yield of the CPU
   if(myproc() && myproc()->state == RUNNING && 
      tf->trapno == T_IRQ0 + IRQ_TIMER) { 
-    myproc()->actual_runtime += 1000;
-    if (myproc()->actual_runtime - myproc()->scheduled_time >= myproc()->time_slice) {
+    if (slicetick()) {
       yield();
     }
   }
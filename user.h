@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct memstat;
+struct bcachestat;
+struct iostat;
 
 // system calls
 int fork(void);
@@ -29,6 +32,11 @@ int ps(int);
 uint mmap(uint, int, int, int, int, int);
 int munmap(uint);
 int freemem(void);
+int memstat(struct memstat*);
+int bcachestat(struct bcachestat*);
+int setbcachemax(int);
+int setiosched(int);
+int iostat(struct iostat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
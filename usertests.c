@@ -7,6 +7,9 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "memstat.h"
+#include "bcachestat.h"
+#include "iostat.h"
 
 char buf[8192];
 char name[3];
@@ -184,6 +187,9 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// Blocks in the big file: some through the double-indirect block.
+#define BIGFILE (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writetest1(void)
 {
@@ -197,7 +203,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +223,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGFILE){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -241,6 +247,70 @@ writetest1(void)
   printf(stdout, "big files ok\n");
 }
 
+// Blocks in dindirect's file: past the single-indirect limit, and
+// into the second indirect block under the double-indirect one.
+#define DIFILE (NDIRECT + NINDIRECT + NINDIRECT + 1)
+
+// Write and read back a file larger than a single-indirect inode
+// can map, then remove it.  Done more times than such files fit
+// on the disk at once, so itrunc() must free the whole tree.
+void
+dindirect(void)
+{
+  int i, round, fd;
+  struct stat st;
+
+  printf(stdout, "double-indirect test\n");
+
+  for(round = 0; round < 5; round++){
+    fd = open("dindirect", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf(stdout, "dindirect: create failed\n");
+      exit();
+    }
+    for(i = 0; i < DIFILE; i++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = round;
+      if(write(fd, buf, 512) != 512){
+        printf(stdout, "dindirect: write block %d failed\n", i);
+        exit();
+      }
+    }
+    if(fstat(fd, &st) < 0 || st.size != DIFILE*512){
+      printf(stdout, "dindirect: size %d, not %d\n", st.size, DIFILE*512);
+      exit();
+    }
+    close(fd);
+
+    fd = open("dindirect", O_RDONLY);
+    if(fd < 0){
+      printf(stdout, "dindirect: open failed\n");
+      exit();
+    }
+    for(i = 0; i < DIFILE; i++){
+      if(read(fd, buf, 512) != 512){
+        printf(stdout, "dindirect: read block %d failed\n", i);
+        exit();
+      }
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != round){
+        printf(stdout, "dindirect: block %d holds %d/%d\n",
+               i, ((int*)buf)[0], ((int*)buf)[1]);
+        exit();
+      }
+    }
+    if(read(fd, buf, 512) != 0){
+      printf(stdout, "dindirect: read past end\n");
+      exit();
+    }
+    close(fd);
+    if(unlink("dindirect") < 0){
+      printf(stdout, "dindirect: unlink failed\n");
+      exit();
+    }
+  }
+  printf(stdout, "double-indirect ok\n");
+}
+
 void
 createtest(void)
 {
@@ -424,6 +494,167 @@ exitwait(void)
   printf(1, "exitwait ok\n");
 }
 
+// memstat() counts each page where it is used, and moves
+// it back to free when it is freed.
+void
+memstattest(void)
+{
+  struct memstat a, b;
+  int fds[2], fd;
+  char *p;
+
+  printf(1, "memstat test\n");
+  if(memstat(&a) != 0){
+    printf(1, "memstat failed\n");
+    exit();
+  }
+
+  if(pipe(fds) != 0){
+    printf(1, "memstat pipe failed\n");
+    exit();
+  }
+  memstat(&b);
+  if(b.pages[MS_PIPE] != a.pages[MS_PIPE] + 1){
+    printf(1, "memstat: pipe pages %d -> %d\n", a.pages[MS_PIPE], b.pages[MS_PIPE]);
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  memstat(&b);
+  if(b.pages[MS_PIPE] != a.pages[MS_PIPE]){
+    printf(1, "memstat: pipe page not freed\n");
+    exit();
+  }
+
+  p = (char*)mmap(0, 4*4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  memstat(&b);
+  if(p == 0 || b.pages[MS_ANON] < a.pages[MS_ANON] + 4){
+    printf(1, "memstat: anonymous pages %d -> %d\n", a.pages[MS_ANON], b.pages[MS_ANON]);
+    exit();
+  }
+  munmap((uint)p);
+
+  fd = open("README", O_RDONLY);
+  p = (char*)mmap(0, 2*4096, PROT_READ, MAP_POPULATE, fd, 0);
+  memstat(&b);
+  if(p == 0 || b.pages[MS_MMAPFILE] != a.pages[MS_MMAPFILE] + 2){
+    printf(1, "memstat: file pages %d -> %d\n", a.pages[MS_MMAPFILE], b.pages[MS_MMAPFILE]);
+    exit();
+  }
+  munmap((uint)p);
+  close(fd);
+  memstat(&b);
+  if(b.pages[MS_ANON] != a.pages[MS_ANON] || b.pages[MS_MMAPFILE] != a.pages[MS_MMAPFILE]){
+    printf(1, "memstat: mmap pages not freed\n");
+    exit();
+  }
+
+  printf(1, "memstat ok\n");
+}
+
+// the buffer cache counts hits, and does not grow past the
+// limit set with setbcachemax().
+void
+bcachetest(void)
+{
+  struct bcachestat a, b;
+  int fd, old;
+
+  printf(1, "bcache test\n");
+  if(bcachestat(&a) != 0 || a.nbuf < NBUF || a.nbuf > a.maxbuf){
+    printf(1, "bcachestat failed\n");
+    exit();
+  }
+  fd = open("README", 0);
+  read(fd, buf, 1024);
+  close(fd);
+  bcachestat(&a);
+  fd = open("README", 0);
+  read(fd, buf, 1024);
+  close(fd);
+  bcachestat(&b);
+  if(b.hits <= a.hits){
+    printf(1, "bcache: re-reading README missed\n");
+    exit();
+  }
+
+  if(setbcachemax(NBUF-1) != -1){
+    printf(1, "bcache: took a limit below NBUF\n");
+    exit();
+  }
+  if((old = setbcachemax(NBUF)) < NBUF){
+    printf(1, "setbcachemax failed\n");
+    exit();
+  }
+  bcachestat(&a);
+  fd = open("usertests", 0);
+  while(read(fd, buf, sizeof(buf)) > 0)
+    ;
+  close(fd);
+  bcachestat(&b);
+  if(b.maxbuf != NBUF || b.nbuf > a.nbuf || b.evictions <= a.evictions){
+    printf(1, "bcache: limit %d, %d -> %d buffers\n", b.maxbuf, a.nbuf, b.nbuf);
+    exit();
+  }
+  setbcachemax(old);
+  bcachestat(&b);
+  if(b.maxbuf != old){
+    printf(1, "bcache: limit not restored\n");
+    exit();
+  }
+
+  printf(1, "bcache ok\n");
+}
+
+// setiosched() switches the disk scheduling policy, and
+// iostat() charges disk traffic to the policy in use.
+void
+ioschedtest(void)
+{
+  struct iostat a, b;
+  int i, fd, old;
+
+  printf(1, "iosched test\n");
+  if(iostat(&a) != 0 || a.sched < 0 || a.sched >= NIOSCHED){
+    printf(1, "iostat failed\n");
+    exit();
+  }
+  if(setiosched(-1) != -1 || setiosched(NIOSCHED) != -1){
+    printf(1, "iosched: took a bad policy\n");
+    exit();
+  }
+  if((old = setiosched(IOSCHED_NOOP)) != a.sched){
+    printf(1, "iosched: old policy %d, not %d\n", old, a.sched);
+    exit();
+  }
+  iostat(&a);
+  if(a.sched != IOSCHED_NOOP){
+    printf(1, "iosched: policy not set\n");
+    exit();
+  }
+
+  fd = open("iosched", O_CREATE|O_RDWR);
+  for(i = 0; i < 8; i++)
+    write(fd, buf, 512);
+  close(fd);
+  // The log may reach the disk a little later.
+  for(i = 0; i < 10; i++){
+    iostat(&b);
+    if(b.policy[IOSCHED_NOOP].writes > a.policy[IOSCHED_NOOP].writes)
+      break;
+    sleep(1);
+  }
+  if(b.policy[IOSCHED_NOOP].writes <= a.policy[IOSCHED_NOOP].writes ||
+     b.policy[IOSCHED_NOOP].commands <= a.policy[IOSCHED_NOOP].commands){
+    printf(1, "iosched: writes not counted\n");
+    exit();
+  }
+  unlink("iosched");
+  setiosched(old);
+
+  printf(1, "iosched ok\n");
+}
+
 void
 mem(void)
 {
@@ -760,6 +991,114 @@ linktest(void)
   printf(1, "linktest ok\n");
 }
 
+// Create path holding s, failing the test if that does not work.
+void
+dcput(char *path, char *s)
+{
+  int fd;
+
+  fd = open(path, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, s, strlen(s)) != strlen(s)){
+    printf(1, "dcache: create %s failed\n", path);
+    exit();
+  }
+  close(fd);
+}
+
+// Check that path holds s.
+void
+dcget(char *path, char *s)
+{
+  int fd, n;
+
+  fd = open(path, 0);
+  if(fd < 0){
+    printf(1, "dcache: open %s failed\n", path);
+    exit();
+  }
+  n = read(fd, buf, sizeof(buf)-1);
+  close(fd);
+  if(n >= 0)
+    buf[n] = 0;
+  if(n < 0 || strcmp(buf, s) != 0){
+    printf(1, "dcache: %s has the wrong contents\n", path);
+    exit();
+  }
+}
+
+// Directory lookups are cached, including names that were not
+// found.  Check that unlink, create and rmdir keep the cache in
+// step with the directories.
+void
+dcachetest(void)
+{
+  printf(1, "dcache test\n");
+
+  unlink("dc.a");
+  unlink("dc.b");
+
+  // A cached miss must not hide a later create.
+  if(open("dc.a", 0) >= 0){
+    printf(1, "dcache: dc.a exists\n");
+    exit();
+  }
+  dcput("dc.a", "one");
+  dcget("dc.a", "one");
+
+  // Unlinking one name of a file leaves the other.
+  if(link("dc.a", "dc.b") < 0){
+    printf(1, "dcache: link dc.a dc.b failed\n");
+    exit();
+  }
+  if(unlink("dc.a") < 0){
+    printf(1, "dcache: unlink dc.a failed\n");
+    exit();
+  }
+  if(open("dc.a", 0) >= 0){
+    printf(1, "dcache: unlinked dc.a still opens\n");
+    exit();
+  }
+  dcget("dc.b", "one");
+
+  // Re-creating the name finds the new file, not the old one.
+  dcput("dc.a", "two");
+  dcget("dc.a", "two");
+  dcget("dc.b", "one");
+
+  // Names in a removed directory must not outlive it, even if a
+  // new directory gets the same name and inode.
+  if(mkdir("dc.d") < 0){
+    printf(1, "dcache: mkdir dc.d failed\n");
+    exit();
+  }
+  dcput("dc.d/x", "three");
+  dcget("dc.d/x", "three");
+  if(unlink("dc.d/x") < 0 || unlink("dc.d") < 0){
+    printf(1, "dcache: rmdir dc.d failed\n");
+    exit();
+  }
+  if(open("dc.d", 0) >= 0 || chdir("dc.d") >= 0){
+    printf(1, "dcache: removed dc.d still opens\n");
+    exit();
+  }
+  if(mkdir("dc.d") < 0){
+    printf(1, "dcache: mkdir dc.d again failed\n");
+    exit();
+  }
+  if(open("dc.d/x", 0) >= 0){
+    printf(1, "dcache: dc.d/x outlived its directory\n");
+    exit();
+  }
+  dcput("dc.d/y", "four");
+  dcget("dc.d/y", "four");
+
+  unlink("dc.d/y");
+  unlink("dc.d");
+  unlink("dc.a");
+  unlink("dc.b");
+  printf(1, "dcache ok\n");
+}
+
 // test concurrent create/link/unlink of the same file
 void
 concreate(void)
@@ -931,6 +1270,168 @@ bigdir(void)
   printf(1, "bigdir ok\n");
 }
 
+// Name number i with prefix c, e.g. x00042.
+static void
+hdname(char *nm, char c, int i)
+{
+  nm[0] = c;
+  nm[1] = '0' + i / 10000;
+  nm[2] = '0' + i / 1000 % 10;
+  nm[3] = '0' + i / 100 % 10;
+  nm[4] = '0' + i / 10 % 10;
+  nm[5] = '0' + i % 10;
+  nm[6] = '\0';
+}
+
+// The kernel's hash of a name in a hashed directory.
+static uint
+hdhash(char *nm)
+{
+  uint h;
+
+  for(h = 0; *nm; nm++)
+    h = h * 31 + (uchar)*nm;
+  return h % NDIRHASH;
+}
+
+// Is nm linked in the current directory?
+static int
+hdfound(char *nm)
+{
+  int fd;
+
+  if((fd = open(nm, O_RDONLY)) < 0)
+    return 0;
+  close(fd);
+  return 1;
+}
+
+// a hashed directory big enough to split blocks of buckets
+// and to chain blocks onto one bucket: lookups, unlinks and
+// re-creates, then rmdir once it is empty.
+void
+hashdir(void)
+{
+  enum { NSPREAD = 400, NSAME = 40 };
+  int i, n, fd, same[NSAME];
+  uint h;
+  char nm[DIRSIZ];
+  struct dirent de;
+
+  printf(1, "hashdir test\n");
+
+  if(mkdir("hd") != 0 || chdir("hd") != 0){
+    printf(1, "hashdir mkdir failed\n");
+    exit();
+  }
+  fd = open("f", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "hashdir create failed\n");
+    exit();
+  }
+  close(fd);
+
+  // Names spread over the buckets make blocks split; names
+  // that all hash to one bucket overflow a block and chain.
+  for(i = 0; i < NSPREAD; i++){
+    hdname(nm, 'x', i);
+    if(link("f", nm) != 0){
+      printf(1, "hashdir link %s failed\n", nm);
+      exit();
+    }
+  }
+  hdname(nm, 'c', 0);
+  h = hdhash(nm);
+  for(i = n = 0; n < NSAME; i++){
+    hdname(nm, 'c', i);
+    if(hdhash(nm) != h)
+      continue;
+    same[n++] = i;
+    if(link("f", nm) != 0){
+      printf(1, "hashdir link %s failed\n", nm);
+      exit();
+    }
+  }
+
+  for(i = 0; i < NSPREAD; i++){
+    hdname(nm, 'x', i);
+    if(!hdfound(nm)){
+      printf(1, "hashdir lookup %s failed\n", nm);
+      exit();
+    }
+  }
+  for(i = 0; i < NSAME; i++){
+    hdname(nm, 'c', same[i]);
+    if(!hdfound(nm)){
+      printf(1, "hashdir lookup %s failed\n", nm);
+      exit();
+    }
+  }
+  hdname(nm, 'x', NSPREAD);
+  if(hdfound(nm)){
+    printf(1, "hashdir found %s, which was never made\n", nm);
+    exit();
+  }
+
+  // Unlink every other name, then make them again.
+  for(i = 0; i < NSPREAD + NSAME; i += 2){
+    hdname(nm, i < NSPREAD ? 'x' : 'c', i < NSPREAD ? i : same[i-NSPREAD]);
+    if(unlink(nm) != 0){
+      printf(1, "hashdir unlink %s failed\n", nm);
+      exit();
+    }
+  }
+  for(i = 0; i < NSPREAD + NSAME; i++){
+    hdname(nm, i < NSPREAD ? 'x' : 'c', i < NSPREAD ? i : same[i-NSPREAD]);
+    if(hdfound(nm) != (i % 2)){
+      printf(1, "hashdir lookup %s after unlink wrong\n", nm);
+      exit();
+    }
+  }
+  for(i = 0; i < NSPREAD + NSAME; i += 2){
+    hdname(nm, i < NSPREAD ? 'x' : 'c', i < NSPREAD ? i : same[i-NSPREAD]);
+    if(link("f", nm) != 0 || !hdfound(nm)){
+      printf(1, "hashdir re-link %s failed\n", nm);
+      exit();
+    }
+  }
+
+  // Reading the directory, as ls does, must show each name
+  // once, skipping the dirents that hold the buckets.
+  fd = open(".", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != 2 + 1 + NSPREAD + NSAME){
+    printf(1, "hashdir read %d names\n", n);
+    exit();
+  }
+
+  chdir("..");
+  if(unlink("hd") == 0){
+    printf(1, "hashdir unlinked a full directory\n");
+    exit();
+  }
+  chdir("hd");
+  for(i = 0; i < NSPREAD + NSAME; i++){
+    hdname(nm, i < NSPREAD ? 'x' : 'c', i < NSPREAD ? i : same[i-NSPREAD]);
+    if(unlink(nm) != 0){
+      printf(1, "hashdir unlink %s failed\n", nm);
+      exit();
+    }
+  }
+  unlink("f");
+  chdir("..");
+  if(unlink("hd") != 0){
+    printf(1, "hashdir rmdir failed\n");
+    exit();
+  }
+
+  printf(1, "hashdir ok\n");
+}
+
 void
 subdir(void)
 {
@@ -1411,6 +1912,207 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+char cowbuf[3*4096];
+
+// Does every byte of n at p equal c?
+static int
+allis(char *p, int n, char c)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(p[i] != c)
+      return 0;
+  return 1;
+}
+
+// fork shares pages copy-on-write: a write by either process
+// must not show through to the other, and a page mapped
+// read-only must still fault when written after fork.
+void
+cowtest(void)
+{
+  int pid, fd, tochild[2], toparent[2];
+  char c, *p;
+
+  printf(1, "cow test\n");
+  memset(cowbuf, 'p', sizeof(cowbuf));
+  if(pipe(tochild) != 0 || pipe(toparent) != 0){
+    printf(1, "cow pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "cow fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    c = allis(cowbuf, sizeof(cowbuf), 'p') ? 'y' : 'n';
+    memset(cowbuf, 'c', sizeof(cowbuf));
+    write(toparent[1], &c, 1);
+    read(tochild[0], &c, 1);  // the parent has written its copy
+    c = allis(cowbuf, sizeof(cowbuf), 'c') ? 'y' : 'n';
+    write(toparent[1], &c, 1);
+    exit();
+  }
+  if(read(toparent[0], &c, 1) != 1 || c != 'y'){
+    printf(1, "cow child did not see the parent's data\n");
+    exit();
+  }
+  if(!allis(cowbuf, sizeof(cowbuf), 'p')){
+    printf(1, "cow child's write changed the parent's page\n");
+    exit();
+  }
+  memset(cowbuf, 'q', sizeof(cowbuf));
+  write(tochild[1], "x", 1);
+  if(read(toparent[0], &c, 1) != 1 || c != 'y'){
+    printf(1, "cow parent's write changed the child's page\n");
+    exit();
+  }
+  wait();
+  close(tochild[0]);
+  close(tochild[1]);
+  close(toparent[0]);
+  close(toparent[1]);
+
+  // The kernel writing a shared page, as read() does, must
+  // copy it too.
+  memset(cowbuf, 'p', sizeof(cowbuf));
+  if(pipe(tochild) != 0 || pipe(toparent) != 0){
+    printf(1, "cow pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    read(tochild[0], &c, 1);
+    c = allis(cowbuf, sizeof(cowbuf), 'p') ? 'y' : 'n';
+    write(toparent[1], &c, 1);
+    exit();
+  }
+  write(toparent[1], "k", 1);
+  if(read(toparent[0], cowbuf, 1) != 1 || cowbuf[0] != 'k'){
+    printf(1, "cow read into a shared page failed\n");
+    exit();
+  }
+  write(tochild[1], "x", 1);
+  if(read(toparent[0], &c, 1) != 1 || c != 'y'){
+    printf(1, "cow read() changed the child's page\n");
+    exit();
+  }
+  wait();
+  close(tochild[0]);
+  close(tochild[1]);
+  close(toparent[0]);
+  close(toparent[1]);
+
+  // A read-only file mapping stays read-only in the child.
+  fd = open("README", O_RDONLY);
+  p = (char*)mmap(0, 4096, PROT_READ, MAP_POPULATE, fd, 0);
+  if(fd < 0 || p == 0){
+    printf(1, "cow mmap failed\n");
+    exit();
+  }
+  pipe(toparent);
+  pid = fork();
+  if(pid == 0){
+    close(toparent[0]);
+    p[0] = 'w';
+    write(toparent[1], "x", 1);
+    exit();
+  }
+  close(toparent[1]);
+  if(read(toparent[0], &c, 1) != 0){
+    printf(1, "cow child wrote a read-only mapping\n");
+    exit();
+  }
+  wait();
+  close(toparent[0]);
+  munmap((uint)p);
+  close(fd);
+
+  printf(1, "cow ok\n");
+}
+
+// The byte at offset off of the mmapfault test file.
+static char
+mfbyte(int off)
+{
+  return 'a' + (off / 4096 + off % 13) % 26;
+}
+
+// pages of a mapping are brought in as they are touched, out
+// of order, in and past the first fault-around window, and a
+// page of an anonymous mapping reads as zero until written.
+void
+mmapfault(void)
+{
+  enum { NPAGE = 12, SIZE = NPAGE*4096 - 2048 };
+  static int order[] = { 10, 2, 11, 9, 0, 7, 5, 1, 8, 3, 6, 4 };
+  int i, j, fd, pg, off;
+  char *p;
+
+  printf(1, "mmapfault test\n");
+
+  fd = open("mf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "mmapfault create failed\n");
+    exit();
+  }
+  for(off = 0; off < SIZE; off += j){
+    j = SIZE - off < 4096 ? SIZE - off : 4096;
+    for(i = 0; i < j; i++)
+      buf[i] = mfbyte(off + i);
+    if(write(fd, buf, j) != j){
+      printf(1, "mmapfault write failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  fd = open("mf", O_RDONLY);
+  p = (char*)mmap(0, NPAGE*4096, PROT_READ, 0, fd, 0);
+  if(fd < 0 || p == 0){
+    printf(1, "mmapfault mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < NPAGE; i++){
+    pg = order[i];
+    for(j = 0; j < 4096; j++){
+      off = pg*4096 + j;
+      if(p[off] != (off < SIZE ? mfbyte(off) : 0)){
+        printf(1, "mmapfault page %d byte %d wrong\n", pg, j);
+        exit();
+      }
+    }
+  }
+  munmap((uint)p);
+  close(fd);
+  unlink("mf");
+
+  p = (char*)mmap(0, NPAGE*4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS, -1, 0);
+  if(p == 0){
+    printf(1, "mmapfault anonymous mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < NPAGE; i++){
+    pg = order[i];
+    if(p[pg*4096 + 7] != 0){
+      printf(1, "mmapfault anonymous page %d not zero\n", pg);
+      exit();
+    }
+    p[pg*4096 + 7] = pg + 1;
+  }
+  for(pg = 0; pg < NPAGE; pg++){
+    if(p[pg*4096 + 7] != pg + 1){
+      printf(1, "mmapfault anonymous page %d lost its write\n", pg);
+      exit();
+    }
+  }
+  munmap((uint)p);
+
+  printf(1, "mmapfault ok\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1768,11 +2470,14 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  cowtest();
+  mmapfault();
   validatetest();
 
   opentest();
   writetest();
   writetest1();
+  dindirect();
   createtest();
 
   openiputtest();
@@ -1780,6 +2485,9 @@ main(int argc, char *argv[])
   iputtest();
 
   mem();
+  memstattest();
+  bcachetest();
+  ioschedtest();
   pipe1();
   preempt();
   exitwait();
@@ -1789,11 +2497,13 @@ main(int argc, char *argv[])
   bigfile();
   subdir();
   linktest();
+  dcachetest();
   unlinkread();
   dirfile();
   iref();
   forktest();
   bigdir(); // slow
+  hashdir(); // slow
 
   uio();
 
@@ -0,0 +1,264 @@
+// virtio-blk disk driver, for the legacy PCI interface that
+// QEMU offers with -device virtio-blk-pci.  A drop-in for ide.c:
+// build with DISK=virtio.  It serves disk 1, the file system;
+// the boot disk stays on IDE and the kernel never reads it.
+//
+// Unlike IDE, the device takes many requests at once.  Each
+// command from ioqnext() becomes one request: a descriptor for
+// the header, one for each buf, and one for the status byte.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+#include "virtio.h"
+
+#define SECTOR_SIZE  512
+#define QMAX         256  // largest queue we have room for
+#define MAXBLOCKS    32   // most blocks in one request
+
+int ideirq;
+
+// The queue memory must be physically contiguous and page
+// aligned, with the used ring starting on a page boundary.
+static uchar vring[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// You must hold disk.lock while touching anything below.
+static struct {
+  struct spinlock lock;
+  ushort iobase;
+  int n;                        // entries in the queue
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  struct vring_used *used;
+  ushort usedidx;               // next used entry to look at
+  char free[QMAX];              // is descriptor free?
+  int nfree;
+
+  // For each request, by its first descriptor.
+  struct {
+    struct virtio_blk_req hdr;
+    uchar status;
+    struct buf *b;              // chain of bufs, through qnext
+  } req[QMAX];
+} disk;
+
+void
+ideinit(void)
+{
+  uint tag, bar;
+  int i;
+
+  initlock(&disk.lock, "virtio");
+  ioschedinit();
+
+  if(pcifind(VIRTIO_VENDOR, VIRTIO_BLKDEV, -1, -1, &tag) < 0)
+    panic("virtio: no disk");
+  bar = pciread(tag, PCI_BAR0);
+  if((bar & 1) == 0)
+    panic("virtio: BAR0 not I/O");
+  pciwrite(tag, PCI_CMD, pciread(tag, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MASTER);
+  disk.iobase = bar & 0xFFFC;
+
+  // Reset, then say we know how to drive it.  We need no features.
+  outb(disk.iobase + VIRTIO_STATUS, 0);
+  outb(disk.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+  outb(disk.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  outl(disk.iobase + VIRTIO_GUESTFEATURES, 0);
+
+  // The legacy interface fixes the queue size; lay out the
+  // rings for it in vring.
+  outw(disk.iobase + VIRTIO_QUEUESEL, 0);
+  disk.n = inw(disk.iobase + VIRTIO_QUEUESIZE);
+  if(disk.n == 0 || disk.n > QMAX)
+    panic("virtio: queue size");
+  disk.desc = (struct vring_desc*)vring;
+  disk.avail = (struct vring_avail*)(vring + disk.n*sizeof(struct vring_desc));
+  disk.used = (struct vring_used*)(vring +
+    PGROUNDUP(disk.n*sizeof(struct vring_desc) + (3 + disk.n)*sizeof(ushort)));
+  for(i = 0; i < disk.n; i++)
+    disk.free[i] = 1;
+  disk.nfree = disk.n;
+  outl(disk.iobase + VIRTIO_QUEUEPFN, V2P(vring) >> PTXSHIFT);
+
+  ideirq = pciread(tag, PCI_INTR) & 0xFF;
+  ioapicenable(ideirq, ncpu - 1);
+  outb(disk.iobase + VIRTIO_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_OK);
+}
+
+static int
+allocdesc(void)
+{
+  int i;
+
+  for(i = 0; i < disk.n; i++){
+    if(disk.free[i]){
+      disk.free[i] = 0;
+      disk.nfree--;
+      return i;
+    }
+  }
+  panic("virtio: out of descriptors");
+}
+
+// Send the device as many queued commands as there are
+// descriptors for.  Caller must hold disk.lock.
+static void
+virtiostart(void)
+{
+  struct buf *b, *p;
+  int head, d, prev, max, started;
+
+  started = 0;
+  while((max = disk.nfree - 2) > 0){
+    if(max > MAXBLOCKS)
+      max = MAXBLOCKS;
+    if((b = ioqnext(max)) == 0)
+      break;
+
+    head = allocdesc();
+    disk.req[head].hdr.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    disk.req[head].hdr.reserved = 0;
+    disk.req[head].hdr.sector = b->blockno * (BSIZE/SECTOR_SIZE);
+    disk.req[head].status = 0xff;
+    disk.req[head].b = b;
+    disk.desc[head].addr = V2P(&disk.req[head].hdr);
+    disk.desc[head].len = sizeof(disk.req[head].hdr);
+    disk.desc[head].flags = VRING_DESC_F_NEXT;
+
+    prev = head;
+    for(p = b; p; p = p->qnext){
+      d = allocdesc();
+      disk.desc[d].addr = V2P(p->data);
+      disk.desc[d].len = BSIZE;
+      disk.desc[d].flags = VRING_DESC_F_NEXT;
+      if(!(b->flags & B_DIRTY))
+        disk.desc[d].flags |= VRING_DESC_F_WRITE;
+      disk.desc[prev].next = d;
+      prev = d;
+    }
+
+    d = allocdesc();
+    disk.desc[d].addr = V2P(&disk.req[head].status);
+    disk.desc[d].len = 1;
+    disk.desc[d].flags = VRING_DESC_F_WRITE;
+    disk.desc[prev].next = d;
+
+    disk.avail->ring[disk.avail->idx % disk.n] = head;
+    __sync_synchronize();
+    disk.avail->idx++;
+    started = 1;
+  }
+  __sync_synchronize();
+  if(started)
+    outw(disk.iobase + VIRTIO_QUEUENOTIFY, 0);
+}
+
+// Interrupt handler.
+void
+ideintr(void)
+{
+  struct buf *b, *done, *next;
+  void (*fn)(struct buf*);
+  int d;
+
+  acquire(&disk.lock);
+
+  // Reading the ISR acknowledges the interrupt.
+  inb(disk.iobase + VIRTIO_ISR);
+
+  done = 0;
+  __sync_synchronize();
+  while(disk.usedidx != disk.used->idx){
+    d = disk.used->ring[disk.usedidx % disk.n].id;
+    disk.usedidx++;
+    if(disk.req[d].status != 0)
+      panic("virtio: request failed");
+
+    for(b = disk.req[d].b; b; b = next){
+      next = b->qnext;
+      ioqdone(b);
+
+      // Wake process waiting for this buf.
+      b->flags |= B_VALID;
+      b->flags &= ~B_DIRTY;
+      wakeup(b);
+      if(b->iodone){
+        b->qnext = done;
+        done = b;
+      }
+    }
+
+    // Free the request's descriptors.
+    for(;;){
+      disk.free[d] = 1;
+      disk.nfree++;
+      if((disk.desc[d].flags & VRING_DESC_F_NEXT) == 0)
+        break;
+      d = disk.desc[d].next;
+    }
+  }
+
+  virtiostart();
+  release(&disk.lock);
+
+  // Nobody waits for a buf with a callback, so it is safe
+  // to use them after releasing disk.lock.
+  for(b = done; b; b = next){
+    next = b->qnext;
+    fn = b->iodone;
+    b->iodone = 0;
+    fn(b);
+  }
+}
+
+//PAGEBREAK!
+// Start syncing buf with disk, without waiting for it.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// When the request is done, ideintr calls b->iodone(b), if set.
+void
+idesubmit(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("idesubmit: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("idesubmit: nothing to do");
+  if(b->dev != 1)
+    panic("idesubmit: request not for disk 1");
+
+  acquire(&disk.lock);
+  ioqadd(b);
+  virtiostart();
+  release(&disk.lock);
+}
+
+// Wait for the request for b started by idesubmit to finish.
+void
+idewaitbuf(struct buf *b)
+{
+  acquire(&disk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
+    sleep(b, &disk.lock);
+  }
+  release(&disk.lock);
+}
+
+// Sync buf with disk and wait for it.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  idewaitbuf(b);
+}
@@ -0,0 +1,58 @@
+// virtio device definitions, for the legacy PCI interface.
+// See the virtio specification, "Legacy Interfaces".
+
+// Registers, at offsets from the I/O port in BAR0.
+#define VIRTIO_DEVFEATURES  0x00  // 32 bits
+#define VIRTIO_GUESTFEATURES 0x04 // 32 bits
+#define VIRTIO_QUEUEPFN     0x08  // 32 bits: queue address / 4096
+#define VIRTIO_QUEUESIZE    0x0C  // 16 bits
+#define VIRTIO_QUEUESEL     0x0E  // 16 bits
+#define VIRTIO_QUEUENOTIFY  0x10  // 16 bits
+#define VIRTIO_STATUS       0x12  // 8 bits
+#define VIRTIO_ISR          0x13  // 8 bits, cleared by reading
+
+// Status register bits.
+#define VIRTIO_STATUS_ACK     1
+#define VIRTIO_STATUS_DRIVER  2
+#define VIRTIO_STATUS_OK      4
+
+#define VIRTIO_VENDOR   0x1AF4
+#define VIRTIO_BLKDEV   0x1001  // legacy (transitional) block device
+
+// A descriptor: one piece of memory for the device.
+struct vring_desc {
+  uint64 addr;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VRING_DESC_F_NEXT   1  // chained with next
+#define VRING_DESC_F_WRITE  2  // device writes (vs read)
+
+// Descriptor chains offered to the device.
+struct vring_avail {
+  ushort flags;
+  ushort idx;       // where the driver puts the next ring entry
+  ushort ring[];
+};
+
+// Descriptor chains the device has finished with.
+struct vring_used_elem {
+  uint id;          // head of the finished chain
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;       // where the device puts the next ring entry
+  struct vring_used_elem ring[];
+};
+
+// The first descriptor of a block request points to this.
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  uint64 sector;
+};
+#define VIRTIO_BLK_T_IN   0  // read
+#define VIRTIO_BLK_T_OUT  1  // write
@@ -4,8 +4,11 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "rbtree.h"
 #include "proc.h"
 #include "elf.h"
+#include "memstat.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -44,6 +47,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   } else {
     if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
       return 0;
+    ksetuse((char*)pgtab, MS_PGTBL);
     // Make sure all those PTE_P bits are zero.
     memset(pgtab, 0, PGSIZE);
     // The permissions here are overly generous, but they can
@@ -123,6 +127,7 @@ setupkvm(void)
 
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
+  ksetuse((char*)pgdir, MS_PGTBL);
   memset(pgdir, 0, PGSIZE);
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
@@ -187,6 +192,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
   mem = kalloc();
+  ksetuse(mem, MS_ANON);
   memset(mem, 0, PGSIZE);
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
@@ -237,6 +243,7 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
+    ksetuse(mem, MS_ANON);
     memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
@@ -310,15 +317,84 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Map the page that pte points to into pgdir at va as well.
+// If the page is writable, both mappings become read-only and
+// copy-on-write; the first write through either one copies it
+// (see cowfault).  The caller must flush the TLB for pte's
+// page table.
+int
+sharepage(pde_t *pgdir, pte_t *pte, uint va)
+{
+  uint pa;
+
+  pa = PTE_ADDR(*pte);
+  if(*pte & PTE_W)
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+  if(mappages(pgdir, (void*)va, PGSIZE, pa, PTE_FLAGS(*pte)) < 0)
+    return -1;
+  kincref(P2V(pa));
+  return 0;
+}
+
+// Handle a write fault at va in the current page table pgdir.
+// If the page is copy-on-write, give this page table its own
+// writable copy (or just the page back, if nobody else has it)
+// and return 0.  Otherwise return -1.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & PTE_P) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    ksetuse(mem, kgetuse(P2V(pa)));
+    memmove(mem, P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    kfree(P2V(pa));
+  }
+  lcr3(V2P(pgdir));
+  return 0;
+}
+
+// Copy every copy-on-write page in [va, va+n) now, so that
+// the kernel can write there without taking a fault, which
+// it may not survive while holding a lock.
+// Returns -1 if out of memory.
+int
+cowbreak(pde_t *pgdir, uint va, uint n)
+{
+  uint a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(pgdir, (void*)a, 0);
+    if(pte != 0 && (*pte & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW) &&
+       cowfault(pgdir, a) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  Pages are shared copy-on-write;
+// the caller must flush the TLB for pgdir.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
   pte_t *pte;
-  uint pa, i, flags;
-  char *mem;
+  uint i;
 
   if((d = setupkvm()) == 0)
     return 0;
@@ -327,15 +403,8 @@ copyuvm(pde_t *pgdir, uint sz)
       panic("copyuvm: pte should exist");
     if(!(*pte & PTE_P))
       panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
+    if(sharepage(d, pte, i) < 0)
       goto bad;
-    }
   }
   return d;
 
@@ -9,6 +9,24 @@ inb(ushort port)
   return data;
 }
 
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 static inline void
 insl(int port, void *addr, int cnt)
 {
@@ -30,6 +48,12 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -117,6 +141,25 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until one arrives.  sti only
+// takes effect after the following instruction, so an
+// interrupt cannot slip in between the two.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
+// Read the time-stamp counter.
+static inline uint64
+rdtsc(void)
+{
+  uint64 tsc;
+
+  asm volatile("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -130,6 +173,17 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically add n to *addr and return the old value.
+static inline uint
+xadd(volatile uint *addr, uint n)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (n), "+m" (*addr) :
+               :
+               "cc");
+  return n;
+}
+
 static inline uint
 rcr2(void)
 {